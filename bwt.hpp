@@ -6,117 +6,294 @@
 //  Copyright © 2020 Phuc Nguyen. All rights reserved.
 //
 
+#ifndef BWT_HPP
+#define BWT_HPP
+
 #include <vector>
-#include <unordered_map>
+#include <cstdint>
 #include <algorithm>
+#include <cassert>
 
 using namespace std;
 
 const int BWT_SENTINEL = 256;
+// Upper bound on inverse BWT cursors per block
+const int BWT_MAX_CURSORS = 8;
 
-bool Compare(const vector<int>& lhs, const vector<int>& rhs) {
-    if (lhs[1] < rhs[1]) return true;
-    else if (lhs[1] > rhs[1]) return false;
-    return lhs[2] < rhs[2];
-}
-
-vector<uint8_t> bwt2(const vector<uint8_t>& input, int& index) {
-    vector<int> v_input = vector<int>(input.begin(), input.end());
-    v_input.push_back(BWT_SENTINEL);
-    vector<int> copy = vector<int>(v_input);
+// Text view used by the top level of SA-IS. It reads the block bytes in place
+// and appends two virtual symbols: BWT_SENTINEL (which must sort after every
+// byte, as the original prefix doubling did) and a unique smallest terminator
+// that SA-IS needs. Bytes are shifted up by one to make room for the terminator.
+struct SentinelText {
+    const uint8_t* data;
+    int size;
+    int operator[](int i) const {
+        return i < size ? data[i] + 1 : (i == size ? BWT_SENTINEL + 1 : 0);
+    }
+};
 
-    int size = (int)v_input.size();
+template <typename Text>
+void GetBuckets(const Text& s, int n, vector<int32_t>& bkt, int K, bool end) {
+    fill(bkt.begin(), bkt.end(), 0);
+    for (int i = 0; i < n; i++) {
+        bkt[s[i]]++;
+    }
+    int sum = 0;
+    for (int i = 0; i < K; i++) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
 
-    //
-    sort(copy.begin(), copy.end());
-    copy.erase(unique(copy.begin(), copy.end()), copy.end());
+template <typename Text>
+void InduceL(const Text& s, int32_t* SA, int n, const vector<uint8_t>& stype, vector<int32_t>& bkt, int K) {
+    GetBuckets(s, n, bkt, K, false);
+    for (int i = 0; i < n; i++) {
+        int j = SA[i] - 1;
+        if (j >= 0 && !stype[j]) {
+            SA[bkt[s[j]]++] = j;
+        }
+    }
+}
 
-    unordered_map<int, int> inp_map;
-    for (size_t i = 0; i < copy.size(); i++) {
-        inp_map[copy[i]] = (int)i;
+template <typename Text>
+void InduceS(const Text& s, int32_t* SA, int n, const vector<uint8_t>& stype, vector<int32_t>& bkt, int K) {
+    GetBuckets(s, n, bkt, K, true);
+    for (int i = n - 1; i >= 0; i--) {
+        int j = SA[i] - 1;
+        if (j >= 0 && stype[j]) {
+            SA[--bkt[s[j]]] = j;
+        }
     }
+}
 
-    //
-    vector<int> inp_idxs;
-    for (int ch: v_input) {
-        inp_idxs.push_back(inp_map[ch]);
+// SA-IS (Nong, Zhang & Chan): linear time suffix sorting.
+// s[n-1] must be the unique smallest symbol, all symbols are in [0, K).
+// The reduced problem is solved recursively inside SA itself, so apart from
+// the type array and the buckets no extra memory is needed.
+template <typename Text>
+void SAIS(const Text& s, int32_t* SA, int n, int K) {
+    // S-type = 1, L-type = 0
+    vector<uint8_t> stype(n);
+    stype[n-1] = 1;
+    for (int i = n - 2; i >= 0; i--) {
+        stype[i] = s[i] < s[i+1] || (s[i] == s[i+1] && stype[i+1]);
     }
-    inp_idxs.push_back(-1);
+    auto is_lms = [&](int i) { return i > 0 && stype[i] && !stype[i-1]; };
 
-    //
-    vector<vector<int>> suffix;
-    for (size_t i = 0; i < size; i++) {
-        suffix.push_back(vector<int>{static_cast<int>(i), inp_idxs[i], inp_idxs[i+1]});
+    // Stage 1: sort the LMS substrings by induction
+    vector<int32_t> bkt(K);
+    GetBuckets(s, n, bkt, K, true);
+    fill(SA, SA + n, -1);
+    for (int i = 1; i < n; i++) {
+        if (is_lms(i)) {
+            SA[--bkt[s[i]]] = i;
+        }
     }
+    InduceL(s, SA, n, stype, bkt, K);
+    InduceS(s, SA, n, stype, bkt, K);
 
-    // Had some bugs with unstable sorting
-    stable_sort(suffix.begin(), suffix.end(), &Compare);
-    vector<int> idxs(size, 0);
+    // Compact the sorted LMS substrings into the front of SA
+    int n1 = 0;
+    for (int i = 0; i < n; i++) {
+        if (is_lms(SA[i])) {
+            SA[n1++] = SA[i];
+        }
+    }
 
-    int k = 2;
-    while (k < size) {
-        int r = 0, prev_r = suffix[0][1];
-        for (size_t i = 0; i < size; i++) {
-            size_t safe_idx = i == 0 ? size - 1 : i - 1;
-            if (suffix[i][1] != prev_r || suffix[safe_idx][2] != suffix[i][2]) {
-                r++;
+    // Name the LMS substrings, names go into the back half of SA
+    fill(SA + n1, SA + n, -1);
+    int name = 0, prev = -1;
+    for (int i = 0; i < n1; i++) {
+        int pos = SA[i];
+        bool diff = false;
+        for (int d = 0; d < n; d++) {
+            if (prev == -1 || s[pos+d] != s[prev+d] || stype[pos+d] != stype[prev+d]) {
+                diff = true;
+                break;
+            } else if (d > 0 && (is_lms(pos+d) || is_lms(prev+d))) {
+                break;
             }
-            prev_r = suffix[i][1];
-            suffix[i][1] = r;
-            idxs[suffix[i][0]] = (int)i;
         }
-        for (size_t i = 0; i < size; i++) {
-            int next = suffix[i][0] + k;
-            suffix[i][2] = next < size ? suffix[idxs[next]][1] : -1;
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        SA[n1 + pos/2] = name - 1;
+    }
+    for (int i = n - 1, j = n - 1; i >= n1; i--) {
+        if (SA[i] >= 0) {
+            SA[j--] = SA[i];
         }
-        stable_sort(suffix.begin(), suffix.end(), &Compare);
-        k<<=1;
     }
 
-    vector<int> ref;
-    for (auto e: suffix) {
-        ref.push_back(e[0] - 1);
+    // Stage 2: sort the reduced string, recursing only if names are not unique
+    int32_t* s1 = SA + n - n1;
+    if (name < n1) {
+        SAIS<const int32_t*>(s1, SA, n1, name);
+    } else {
+        for (int i = 0; i < n1; i++) {
+            SA[s1[i]] = i;
+        }
     }
 
-    vector<uint8_t> res;
-    for (size_t i = 0; i < ref.size(); i++) {
-        int idx = ref[i];
-        int ch = idx >= 0 ? v_input[idx] : v_input[size-1];
-        if (ch == BWT_SENTINEL) {
-            index = (int)i;
-        } else {
-            res.push_back((uint8_t)ch);
+    // Stage 3: induce the full suffix array from the sorted LMS suffixes
+    GetBuckets(s, n, bkt, K, true);
+    for (int i = 1, j = 0; i < n; i++) {
+        if (is_lms(i)) {
+            s1[j++] = i;
         }
     }
+    for (int i = 0; i < n1; i++) {
+        SA[i] = s1[SA[i]];
+    }
+    fill(SA + n1, SA + n, -1);
+    for (int i = n1 - 1; i >= 0; i--) {
+        int j = SA[i];
+        SA[i] = -1;
+        SA[--bkt[s[j]]] = j;
+    }
+    InduceL(s, SA, n, stype, bkt, K);
+    InduceS(s, SA, n, stype, bkt, K);
+}
 
-//    index = (int)distance(ref.begin(), find(ref.begin(), ref.end(), -1));
+// Suffix array of input + SENTINEL, SA has size + 1 entries.
+inline void SuffixArray(const uint8_t* input, int size, vector<int32_t>& SA) {
+    // size bytes + SENTINEL + terminator
+    int n = size + 2;
+    SA.resize(n);
+    SAIS(SentinelText{input, size}, SA.data(), n, BWT_SENTINEL + 2);
+    // The terminator is always the first suffix, drop it
+    SA.erase(SA.begin());
+}
+
+// Text position where decoding cursor k starts when a block of size bytes
+// is split into num_cursors segments.
+inline int CursorStart(int k, int size, int num_cursors) {
+    return (int)((long long)k * size / num_cursors);
+}
 
+// BWT with extra start rows for parallel inverse BWT.
+// cursors[k-1] is the row of the suffix starting at CursorStart(k, ...), for
+// k in [1, num_cursors), so the decoder can walk num_cursors chains at once.
+// SA and output are scratch the caller can reuse across blocks.
+inline void bwt2(const uint8_t* input, int size, int& index, vector<int>& cursors, int num_cursors,
+                 vector<int32_t>& SA, vector<uint8_t>& output) {
+    SuffixArray(input, size, SA);
+
+    cursors.assign(num_cursors - 1, 0);
+    // The row whose suffix starts at 0 is preceded by SENTINEL, skip it
+    output.resize(size);
+    uint8_t* res = output.data();
+    int j = 0;
+    for (int i = 0; i <= size; i++) {
+        int pos = SA[i];
+        if (pos == 0) {
+            index = i;
+        } else {
+            res[j++] = input[pos - 1];
+        }
+        if (num_cursors > 1 && pos < size) {
+            int k = (int)((long long)pos * num_cursors / size);
+            for (; k <= num_cursors && CursorStart(k, size, num_cursors) <= pos; k++) {
+                if (k > 0 && k < num_cursors && CursorStart(k, size, num_cursors) == pos) {
+                    cursors[k-1] = i;
+                }
+            }
+        }
+    }
+}
+
+inline vector<uint8_t> bwt2(const uint8_t* input, int size, int& index, vector<int>& cursors, int num_cursors) {
+    vector<int32_t> SA;
+    vector<uint8_t> res;
+    bwt2(input, size, index, cursors, num_cursors, SA, res);
     return res;
 }
 
+inline vector<uint8_t> bwt2(const vector<uint8_t>& input, int& index, vector<int>& cursors, int num_cursors) {
+    return bwt2(input.data(), (int)input.size(), index, cursors, num_cursors);
+}
+
+inline vector<uint8_t> bwt2(const vector<uint8_t>& input, int& index) {
+    vector<int> cursors;
+    return bwt2(input, index, cursors, 1);
+}
+
 // A good observation is that the index == the position of SENTINEL
+//
+// The inverse follows the LF mapping backwards (row -> row of the next text
+// symbol). It is built with a counting sort into one packed u32 per row:
+// the next row in the high 24 bits and the last column byte in the low 8 bits,
+// so each step of a chain is a single random access.
+// Extra cursors (see bwt2) split the text into independent chains which are
+// walked in lockstep to overlap their cache misses.
+// The decoded block (input.size() bytes) is written to output, tt is
+// scratch the caller can reuse across blocks.
+inline void ibwt(const vector<uint8_t>& input, int index, const vector<int>& cursors, uint8_t* output,
+                 vector<uint32_t>& tt) {
+    int size = (int)input.size();
+    assert(size < (1 << 24));
+    tt.resize(size + 1);
 
-vector<uint8_t> ibwt(const vector<uint8_t>& input, int index) {
-    vector<int> copy_input(input.begin(), input.end());
-    copy_input.insert(copy_input.begin() + index, BWT_SENTINEL);
-    vector<pair<int, int>> idxs;
-    for (size_t i = 0; i < copy_input.size(); i++) {
-        idxs.push_back(make_pair(copy_input[i], i));
+    // Rows of the last column, SENTINEL sits at index and sorts after every byte
+    int C[256] = {0};
+    for (int i = 0; i < size; i++) {
+        C[input[i]]++;
+    }
+    int sum = 0;
+    for (int c = 0; c < 256; c++) {
+        int count = C[c];
+        C[c] = sum;
+        sum += count;
+    }
+    for (int i = 0; i < index; i++) {
+        tt[i] = input[i];
     }
-    stable_sort(idxs.begin(), idxs.end());
-    vector<int> sorted_idxs;
-    for (size_t i = 0; i < idxs.size(); i++) {
-        sorted_idxs.push_back(idxs[i].second);
+    tt[index] = 0;
+    for (int i = index; i < size; i++) {
+        tt[i+1] = input[i];
     }
+    for (int i = 0; i < index; i++) {
+        tt[C[input[i]]++] |= (uint32_t)i << 8;
+    }
+    for (int i = index; i < size; i++) {
+        tt[C[input[i]]++] |= (uint32_t)(i+1) << 8;
+    }
+    tt[size] |= (uint32_t)index << 8;
 
-    vector<uint8_t> res;
-    for (size_t i = 0; i < copy_input.size(); i++) {
-        index = sorted_idxs[index];
-        int ch = copy_input[index];
-        if (ch != BWT_SENTINEL) {
-            res.push_back(copy_input[index]);
+    int num_cursors = (int)cursors.size() + 1;
+    assert(num_cursors <= BWT_MAX_CURSORS);
+    uint32_t cur[BWT_MAX_CURSORS];
+    int out[BWT_MAX_CURSORS], end[BWT_MAX_CURSORS];
+    for (int k = 0; k < num_cursors; k++) {
+        cur[k] = tt[k == 0 ? index : cursors[k-1]];
+        out[k] = CursorStart(k, size, num_cursors);
+        end[k] = CursorStart(k + 1, size, num_cursors);
+    }
+
+    uint8_t* dst = output;
+    // Every segment is at least size / num_cursors long
+    int steps = size / num_cursors;
+    for (int s = 0; s < steps; s++) {
+        for (int k = 0; k < num_cursors; k++) {
+            cur[k] = tt[cur[k] >> 8];
+            dst[out[k]++] = (uint8_t)cur[k];
+        }
+    }
+    for (int k = 0; k < num_cursors; k++) {
+        while (out[k] < end[k]) {
+            cur[k] = tt[cur[k] >> 8];
+            dst[out[k]++] = (uint8_t)cur[k];
         }
     }
+}
 
+inline vector<uint8_t> ibwt(const vector<uint8_t>& input, int index, const vector<int>& cursors = {}) {
+    vector<uint8_t> res(input.size());
+    vector<uint32_t> tt;
+    ibwt(input, index, cursors, res.data(), tt);
     return res;
 }
+
+#endif
@@ -0,0 +1,171 @@
+//
+//  crc32c.hpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+// CRC-32C (Castagnoli), the checksum of pzip blocks and streams.
+// x86-64 CPUs with SSE4.2 compute it with the crc32 instruction, on three
+// interleaved streams to hide its latency; other machines use slice-by-8
+// tables. crc32c_combine() joins the checksums of consecutive pieces, so
+// blocks can be checksummed on their own threads.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Reflected polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// a * b modulo the polynomial, both reflected (x^0 is the top bit)
+inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    while (1) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * size) modulo the polynomial: appending size bytes to a CRC
+// register multiplies it by this
+inline uint32_t crc32c_shift(size_t size) {
+    // x^(2^k) for k = 3 ... 66, squared from x^8
+    static const struct Powers {
+        uint32_t x2n[64];
+        Powers() {
+            uint32_t p = 1u << (31 - 8);
+            for (int k = 0; k < 64; k++) {
+                x2n[k] = p;
+                p = crc32c_multmodp(p, p);
+            }
+        }
+    } powers;
+    uint32_t p = 1u << 31;
+    for (int k = 0; size; k++, size >>= 1) {
+        if (size & 1) {
+            p = crc32c_multmodp(powers.x2n[k], p);
+        }
+    }
+    return p;
+}
+
+// t[0] is the classic byte table, t[k] advances a byte through k more zero bytes
+struct Crc32cTables {
+    uint32_t t[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            }
+            t[0][i] = c;
+        }
+        for (int i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+// Updates the CRC register (not inverted) with data, 8 bytes per step
+inline uint32_t crc32c_slice8(uint32_t crc, const uint8_t* data, size_t size) {
+    static const Crc32cTables tables;
+    const uint32_t (*t)[256] = tables.t;
+    while (size >= 8) {
+        // (assumes a little-endian host)
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^ t[5][(word >> 16) & 0xFF] ^ t[4][(word >> 24) & 0xFF] ^
+              t[3][(word >> 32) & 0xFF] ^ t[2][(word >> 40) & 0xFF] ^ t[1][(word >> 48) & 0xFF] ^ t[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint64_t crc32c_hw_words(uint64_t crc, const uint8_t* data, size_t words) {
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, data + 8 * i, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    return crc;
+}
+
+// The crc32 instruction takes 3 cycles but can start every cycle: runs of
+// 3 * CRC32C_STRIPE bytes are split in three streams, joined with crc32c_shift
+#define CRC32C_STRIPE 4096
+
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_hw(uint32_t crc, const uint8_t* data, size_t size) {
+    static const uint32_t stripe_shift = crc32c_shift(CRC32C_STRIPE);
+    uint64_t crc0 = crc;
+    while (size >= 3 * CRC32C_STRIPE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const uint8_t* a = data;
+        const uint8_t* b = data + CRC32C_STRIPE;
+        const uint8_t* c = data + 2 * CRC32C_STRIPE;
+        for (int i = 0; i < CRC32C_STRIPE; i += 8) {
+            uint64_t wa, wb, wc;
+            memcpy(&wa, a + i, 8);
+            memcpy(&wb, b + i, 8);
+            memcpy(&wc, c + i, 8);
+            crc0 = _mm_crc32_u64(crc0, wa);
+            crc1 = _mm_crc32_u64(crc1, wb);
+            crc2 = _mm_crc32_u64(crc2, wc);
+        }
+        crc0 = crc32c_multmodp(stripe_shift, (uint32_t)crc0) ^ (uint32_t)crc1;
+        crc0 = crc32c_multmodp(stripe_shift, (uint32_t)crc0) ^ (uint32_t)crc2;
+        data += 3 * CRC32C_STRIPE;
+        size -= 3 * CRC32C_STRIPE;
+    }
+    crc0 = crc32c_hw_words(crc0, data, size / 8);
+    data += size & ~(size_t)7;
+    size &= 7;
+    uint32_t crc32 = (uint32_t)crc0;
+    while (size--) {
+        crc32 = _mm_crc32_u8(crc32, *data++);
+    }
+    return crc32;
+}
+#endif
+
+// CRC-32C of data, continuing from the checksum crc of what came before
+inline uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc = 0) {
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw) {
+        return ~crc32c_hw(~crc, data, size);
+    }
+#endif
+    return ~crc32c_slice8(~crc, data, size);
+}
+
+// Checksum of A followed by B from the checksums of A and B, size2 = |B|
+inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t size2) {
+    return crc32c_multmodp(crc32c_shift(size2), crc1) ^ crc2;
+}
+
+#endif
@@ -0,0 +1,107 @@
+//
+//  format.hpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+#ifndef FORMAT_HPP
+#define FORMAT_HPP
+
+// Stream header: magic "PZF" followed by a version byte, then from version 2
+// on the block size (4 bytes), which bounds the original length of every block.
+// Version 1 streams always used PZIP_V1_BLOCK_SIZE.
+// Streams without the header (first byte 0 or 1) are the original format,
+// where blocks are not length-prefixed and can only be found by parsing.
+#define PZIP_MAGIC_0 'P'
+#define PZIP_MAGIC_1 'Z'
+#define PZIP_MAGIC_2 'F'
+#define PZIP_VERSION 5
+#define PZIP_HEADER_SIZE 8
+#define PZIP_V1_HEADER_SIZE 4
+#define PZIP_V1_BLOCK_SIZE 900000
+// Set in the version byte (from version 5 on) when the stream was compressed
+// with a dictionary: its ID (4 bytes) follows the block size. Decoders
+// without dictionary support see an unknown version and stop.
+#define PZIP_DICT_STREAM_FLAG 0x80
+#define PZIP_DICT_ID_SIZE 4
+
+// Block size limits, the inverse BWT packs row numbers in 24 bits
+#define PZIP_MIN_BLOCK_SIZE (1 << 16)
+#define PZIP_MAX_BLOCK_SIZE ((1 << 24) - 1)
+
+// Block header: last block flag (1 byte), mode (1 byte), payload length
+// (4 bytes), original length (4 bytes) and from version 3 on the CRC-32C of
+// the original block (4 bytes), then the payload
+#define PZIP_BLOCK_HEADER_SIZE 14
+#define PZIP_V2_BLOCK_HEADER_SIZE 10
+
+// From version 3 on the last block is followed by the CRC-32C of the whole
+// original stream
+#define PZIP_TRAILER_SIZE 4
+
+// Optional index footer after the stream trailer (pcompress --index), for
+// random access. Decoders that read the stream front to back stop at the
+// trailer and never see it. One entry per block:
+//   offset of the block header in the stream (8 bytes)
+//   length of the block header and payload (4 bytes)
+//   offset of the block in the original data (8 bytes)
+// then the index trailer, which ends the file: number of blocks (4 bytes),
+// offset of the first entry in the stream (8 bytes), CRC-32C of the entries
+// (4 bytes), magic "PZX" and index version (4 bytes)
+#define PZIP_INDEX_MAGIC_0 'P'
+#define PZIP_INDEX_MAGIC_1 'Z'
+#define PZIP_INDEX_MAGIC_2 'X'
+#define PZIP_INDEX_VERSION 1
+#define PZIP_INDEX_ENTRY_SIZE 20
+#define PZIP_INDEX_TRAILER_SIZE 20
+
+// Dictionary file (ptrain, --dict): magic "PZD" and version (4 bytes), the
+// dictionary ID (4 bytes, CRC-32C of the rest of the file), the number of
+// tables (1 byte), then for each table its alphabet size (varint) and its
+// normalized counts as in a compact block header, padded to a byte
+#define PZIP_DICT_MAGIC_0 'P'
+#define PZIP_DICT_MAGIC_1 'Z'
+#define PZIP_DICT_MAGIC_2 'D'
+#define PZIP_DICT_VERSION 1
+#define PZIP_DICT_MAX_TABLES 64
+
+// Block modes, low bits of the mode byte
+// FSE_MODE is the original FSE coder, only read for old streams
+#define FSE_MODE 0
+#define RLE_MODE 1
+// FSE with the standard symbol spread and an explicit table log
+#define FSE2_MODE 2
+// FSE2 with 2 or 4 interleaved states sharing one bitstream
+#define FSE_STATES_MODE 3
+// Canonical Huffman with codes of at most HUF_MAX_BITS bits
+#define HUFFMAN_MODE 4
+// The original block copied as is (from version 4 on), for data that does
+// not compress. No flags are set.
+#define STORED_MODE 5
+// FSE with several tables, each segment of the symbols coded with the table
+// picked by its selector (from version 4 on)
+#define FSE_TABLES_MODE 6
+// FSE with a table of the stream's dictionary, which the block names instead
+// of sending its counts (from version 5 on, compact header only)
+#define FSE_DICT_MODE 7
+// Set in the mode byte when extra inverse BWT start rows follow the index
+#define BWT_CURSORS_FLAG 0x80
+// Set in the mode byte when the coded symbols come from MTF_RUN_encode
+// (RUNA/RUNB zero runs) rather than MTF_encode and RLE_encode
+#define MTF_RUN_FLAG 0x40
+// Set in the mode byte (from version 5 on) when the payload has a compact
+// header: integer fields are varints, and the FSE normalized counts and
+// Huffman code lengths are bit-packed
+#define COMPACT_HEADER_FLAG 0x20
+// Set in the mode byte of an FSE2 or FSE states block (from version 5 on,
+// compact header only) that reuses the last FSE table sent in the stream,
+// the one of the closest FSE2 or FSE states block before it without the
+// flag, instead of sending its counts. Blocks of the other modes in between
+// leave that table alone. Only written when CompressOptions::repeat_tables
+// is set.
+#define REPEAT_TABLE_FLAG 0x10
+// Every flag of the mode byte
+#define MODE_FLAGS (BWT_CURSORS_FLAG | MTF_RUN_FLAG | COMPACT_HEADER_FLAG | REPEAT_TABLE_FLAG)
+
+#endif
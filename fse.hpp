@@ -7,14 +7,176 @@
 //
 
 
+#ifndef FSE_HPP
+#define FSE_HPP
+
 #include <vector>
+#include <algorithm>
 #include <numeric>
+#include <cstring>
+#include <cassert>
+#include <cmath>
 
 using namespace std;
 
+// Reads an FSE bitstream from its end towards its start.
+// The reader loads 8 bytes at a time going backwards and serves reads MSB
+// first from a 64-bit container, so the last bits written come out first.
+// BitWriter packs values LSB first, which this reads as is. The original
+// FSE_MODE encoder packed single bits MSB first into bytes, for those streams
+// reverse_bytes flips the bit order inside each byte after loading.
+// Bits before the start of the stream read as zeros.
+class BackwardBitReader {
+public:
+    BackwardBitReader(const u8* data, int size, int skip_bits, bool reverse_bytes = false):
+        data{data}, size{size}, pos{0}, consumed{skip_bits}, reverse_bytes{reverse_bytes} {
+        reload();
+    }
+
+    // Read num_bits (at most 32) bits, the first bit read is the most significant
+    u32 read(int num_bits) {
+        u32 value = num_bits ? (u32)((container << consumed) >> (64 - num_bits)) : 0;
+        consumed += num_bits;
+        if (consumed >= 32) {
+            reload();
+        }
+        return value;
+    }
+
+private:
+    void reload() {
+        pos += consumed >> 3;
+        consumed &= 7;
+        // Load the 8 bytes ending at the current byte, the current byte on top
+        // (assumes a little-endian host)
+        int last = size - 1 - pos;
+        u64 word = 0;
+        if (last >= 7) {
+            memcpy(&word, data + last - 7, 8);
+        } else {
+            for (int i = 0; i <= last; i++) {
+                word |= (u64)data[i] << (8 * (7 - last + i));
+            }
+        }
+        if (reverse_bytes) {
+            word = ((word >> 1) & 0x5555555555555555ULL) | ((word & 0x5555555555555555ULL) << 1);
+            word = ((word >> 2) & 0x3333333333333333ULL) | ((word & 0x3333333333333333ULL) << 2);
+            word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        }
+        container = word;
+    }
+
+    const u8* data;
+    int size;
+    // Bytes fully consumed from the end, bits consumed from the container
+    int pos;
+    int consumed;
+    bool reverse_bytes;
+    u64 container;
+};
+
+// Appends values LSB first through a 64-bit accumulator into a buffer that
+// the caller sized for the worst case plus 8 bytes of slack.
+class BitWriter {
+public:
+    BitWriter(u8* out): start{out}, ptr{out}, acc{0}, count{0} {
+
+    }
+
+    // Write the low num_bits (at most 32) bits of value
+    void write(u32 value, int num_bits) {
+        acc |= (u64)(value & ((1ULL << num_bits) - 1)) << count;
+        count += num_bits;
+        if (count >= 32) {
+            flush();
+        }
+    }
+
+    // Write out every pending bit. Returns the total size in bytes and the
+    // number of unused high bits in the last byte.
+    int finish(int& unused_bits) {
+        flush();
+        unused_bits = count ? 8 - count : 0;
+        if (count) {
+            *ptr++ = (u8)acc;
+        }
+        return (int)(ptr - start);
+    }
+
+private:
+    // Store the whole accumulator and advance over the complete bytes
+    // (assumes a little-endian host)
+    void flush() {
+        memcpy(ptr, &acc, 8);
+        int bytes = count >> 3;
+        ptr += bytes;
+        acc = bytes == 8 ? 0 : acc >> (bytes * 8);
+        count &= 7;
+    }
+
+    u8* start;
+    u8* ptr;
+    u64 acc;
+    int count;
+};
+
+// One decoder step: emit symbol, then the next state is
+// new_state + (next nb_bits bits of the stream), as an offset from L.
+struct DecodeEntry {
+    u16 new_state;
+    u8 symbol;
+    u8 nb_bits;
+};
+
+struct FSEDecodingTable {
+    int table_log;
+    vector<DecodeEntry> entries;
+};
+
+// Encoding transform of one symbol: for a state x in [L, 2L), the encoder
+// writes nb_bits = (x + delta_nb_bits) >> 16 low bits of x, then moves to
+// state_table[(x >> nb_bits) + delta_find_state].
+struct SymbolTransform {
+    int delta_nb_bits;
+    int delta_find_state;
+};
+
+struct FSEEncodingTable {
+    int table_log;
+    vector<u16> state_table;
+    vector<SymbolTransform> symbol_tt;
+};
+
+// Bounds on the FSE table log
+const int FSE_MIN_TABLE_LOG = 5;
+const int FSE_MAX_TABLE_LOG = 15;
+// Largest Exp-Golomb order of the counts in a compact header (4 bits)
+const int FSE_MAX_COUNT_ORDER = 15;
+
+// Multi-table coding: the data is cut into segments of FSE_SEGMENT_SIZE
+// symbols and each segment is coded with one of up to FSE_MAX_TABLES tables.
+// All the tables have the same table log, so a state means the same thing in
+// every table and the coder can switch tables between any two symbols.
+const int FSE_SEGMENT_SIZE = 64;
+const int FSE_MAX_TABLES = 8;
+static_assert(FSE_SEGMENT_SIZE % 4 == 0, "segments must hold whole groups of 1, 2 or 4 interleaved states");
+
+// Table log selection settings
+struct FSEParams {
+    // Largest table log to consider
+    int max_table_log;
+    // Take the smallest table log whose estimated coded size is within this
+    // fraction of the empirical entropy of the data (0 = smallest size)
+    double cost_tolerance;
+    // Tables of the multi-table mode, 1 to code every block with one table
+    int max_tables;
+};
+
 class FSE {
 private:
     const uint8_t PRECISION = 4;
+    // Symbol of each table cell, see SpreadTable
+    vector<u8> spread;
 
     int bitlen(unsigned int n) {
         int len = 0;
@@ -25,80 +187,320 @@ private:
         return len;
     }
 
-    // Count the frequencies and normalize them
-    vector<int> NormalizeCount(const vector<uint8_t>& data, int num_symbols, int PROBABILITY_PRECISION) {
-        int data_size = (int)data.size();
-        double scale_factor = (double)(1<<PROBABILITY_PRECISION) / data_size;
+    // Scales counts to normalized frequencies summing to 1 << table_log,
+    // minimizing the coded size sum(count * log2(L / norm)). Every present
+    // symbol gets at least 1, absent symbols get 0. The cost is convex in
+    // each norm, so starting from rounded proportions and moving single
+    // units to where they save the most until no move helps is optimal.
+    // table_log must leave room for every present symbol.
+    vector<int> NormalizeCount(const vector<int>& counts, int total, int table_log) {
+        int num_symbols = (int)counts.size();
+        int L = 1 << table_log;
+        vector<int> norm(num_symbols, 0);
+        // Symbols below one state get exactly one, the others share what is
+        // left in proportion, which leaves few units to move when a small
+        // block has many rare symbols
+        int rare = 0, rare_total = 0;
+        for (int c: counts) {
+            if (c > 0 && (long long)c * L < total) {
+                rare++;
+                rare_total += c;
+            }
+        }
+        double scale = total > rare_total ? (double)(L - rare) / (total - rare_total) : 0;
+        int sum = 0;
+        for (int s = 0; s < num_symbols; s++) {
+            if (counts[s] > 0) {
+                norm[s] = (long long)counts[s] * L < total ? 1 : max(1, (int)(counts[s] * scale + 0.5));
+                sum += norm[s];
+            }
+        }
 
-        vector<int> freqs(num_symbols);
-        for (int i = 0; i < data_size; i++)
-            freqs[data[i]]++;
+        // Bits saved by giving s one more state, and lost by taking one away,
+        // cached per symbol: a move only changes those of the two symbols
+        // involved, so each step is a scan without any log2
+        vector<double> gains(num_symbols, -1), losses(num_symbols, 1e300);
+        auto update = [&](int s) {
+            gains[s] = counts[s] * log2((norm[s] + 1.0) / norm[s]);
+            losses[s] = norm[s] > 1 ? counts[s] * log2(norm[s] / (norm[s] - 1.0)) : 1e300;
+        };
+        vector<int> present;
+        for (int s = 0; s < num_symbols; s++) {
+            if (counts[s] > 0) {
+                present.push_back(s);
+                update(s);
+            }
+        }
+        auto best_gain = [&]() {
+            int best = present[0];
+            for (int s: present) {
+                if (gains[s] > gains[best]) {
+                    best = s;
+                }
+            }
+            return best;
+        };
+        auto best_loss = [&]() {
+            int best = present[0];
+            for (int s: present) {
+                if (losses[s] < losses[best]) {
+                    best = s;
+                }
+            }
+            return best;
+        };
 
+        for (; sum < L; sum++) {
+            int s = best_gain();
+            norm[s]++;
+            update(s);
+        }
+        for (; sum > L; sum--) {
+            int s = best_loss();
+            norm[s]--;
+            update(s);
+        }
+        while (1) {
+            int from = best_loss(), to = best_gain();
+            if (from == to || gains[to] <= losses[from] + 1e-9) {
+                break;
+            }
+            norm[from]--;
+            norm[to]++;
+            update(from);
+            update(to);
+        }
+        return norm;
+    }
+
+    // Assigns states of the table to symbols in the same order as the
+    // FSE_MODE encoder did: for j = 1, 2, ... each symbol takes the first free
+    // state at or after max(j * L / freqs[i], 2). state_rank is the 1-based
+    // position of the state among the states of its symbol.
+    // A symbol that finds no free state will never find one again, so it is
+    // dropped, and free states are looked up through a union-find over the
+    // next free slot instead of linear probing.
+    void SpreadSymbols(const vector<int>& freqs, int num_symbols, int PROBABILITY_PRECISION, int MAX_STATE,
+                       vector<int>& state_symbol, vector<int>& state_rank) {
+        state_symbol.assign(MAX_STATE+1, -1);
+        state_rank.assign(MAX_STATE+1, 0);
+        vector<int> next_free(MAX_STATE+2);
+        iota(next_free.begin(), next_free.end(), 0);
+        auto find_free = [&](int x) {
+            int root = x;
+            while (next_free[root] != root) {
+                root = next_free[root];
+            }
+            while (next_free[x] != root) {
+                int next = next_free[x];
+                next_free[x] = root;
+                x = next;
+            }
+            return root;
+        };
+
+        vector<int> active;
+        vector<int> ranks(num_symbols, 0);
         for (int i = 0; i < num_symbols; i++) {
-            freqs[i] = (int)(freqs[i] * scale_factor);
+            if (freqs[i] > 0) {
+                active.push_back(i);
+            }
         }
+        for (int j = 1; j <= MAX_STATE && !active.empty(); j++) {
+            size_t kept = 0;
+            for (int i: active) {
+                int state = max((j << PROBABILITY_PRECISION)/freqs[i], 2);
+                if (state > MAX_STATE || (state = find_free(state)) > MAX_STATE) {
+                    continue;
+                }
+                state_symbol[state] = i;
+                state_rank[state] = ++ranks[i];
+                next_free[state] = state + 1;
+                active[kept++] = i;
+            }
+            active.resize(kept);
+        }
+    }
 
-        int sum = accumulate(freqs.begin(), freqs.end(), 0);
-        int diff = (1<<PROBABILITY_PRECISION) - sum;
+    // FSE_MODE decoding table indexed by state - L, for states in [L, 2L)
+    vector<DecodeEntry> CreateLegacyDecodingTable(const vector<int>& freqs, int num_symbols, int PROBABILITY_PRECISION, int MAX_STATE) {
+        vector<int> state_symbol, state_rank;
+        SpreadSymbols(freqs, num_symbols, PROBABILITY_PRECISION, MAX_STATE, state_symbol, state_rank);
 
-        int argmax = (int)distance(freqs.begin(), max_element(freqs.begin(), freqs.end()));
-        freqs[argmax] += diff;
+        int L = 1 << PROBABILITY_PRECISION;
+        vector<DecodeEntry> table(L, DecodeEntry{0, 0, 0});
+        for (int state = L; state <= MAX_STATE; state++) {
+            if (state_symbol[state] < 0) {
+                continue;
+            }
+            // The encoder shifted out bits until the state was the rank,
+            // shift it back up into [L, 2L)
+            int rank = state_rank[state];
+            int nb_bits = PROBABILITY_PRECISION - (bitlen(rank) - 1);
+            table[state - L] = DecodeEntry{(u16)((rank << nb_bits) - L), (u8)state_symbol[state], (u8)nb_bits};
+        }
+        return table;
+    }
 
-        // A symbol must have freq at least 1
-        for (int i = 0; i < num_symbols; i++) {
-            if (freqs[i] == 0) {
-                freqs[i] = 1;
-                freqs[argmax]--;
+    // Spreads symbols over the table by stepping through it with an odd
+    // step, which visits every cell once and scatters each symbol's states.
+    // The result lives in a buffer reused by every table build.
+    const vector<u8>& SpreadTable(const vector<int>& norm, int num_symbols, int table_log) {
+        int table_size = 1 << table_log;
+        int mask = table_size - 1;
+        int step = (table_size >> 1) + (table_size >> 3) + 3;
+        vector<u8>& table_symbol = spread;
+        table_symbol.resize(table_size);
+        int position = 0;
+        for (int s = 0; s < num_symbols; s++) {
+            for (int i = 0; i < norm[s]; i++) {
+                table_symbol[position] = (u8)s;
+                position = (position + step) & mask;
             }
         }
+        assert(position == 0);
+        return table_symbol;
+    }
 
-        return freqs;
+    template <int K>
+    void EncodeStates(const vector<uint8_t>& data, const FSEEncodingTable& table, vector<u8>& encoded_stream,
+                      int& byte_offset, vector<int>& final_states) {
+        int data_size = (int)data.size();
+        encoded_stream.resize((size_t)data_size * table.table_log / 8 + 16);
+        BitWriter writer(encoded_stream.data());
+
+        u32 state[K];
+        for (int k = 0; k < K; k++) {
+            state[k] = 1u << table.table_log;
+        }
+        const SymbolTransform* symbol_tt = table.symbol_tt.data();
+        const u16* state_table = table.state_table.data();
+        auto encode = [&](u32& x, u8 symbol) {
+            const SymbolTransform& tt = symbol_tt[symbol];
+            int nb_bits = (int)((x + tt.delta_nb_bits) >> 16);
+            writer.write(x, nb_bits);
+            x = state_table[(int)(x >> nb_bits) + tt.delta_find_state];
+        };
+        int i = 0;
+        for (; i + K <= data_size; i += K) {
+            for (int k = 0; k < K; k++) {
+                encode(state[k], data[i + k]);
+            }
+        }
+        for (; i < data_size; i++) {
+            encode(state[i % K], data[i]);
+        }
+
+        encoded_stream.resize(writer.finish(byte_offset));
+        final_states.assign(state, state + K);
     }
 
-    vector<vector<int>> CreateEncodingTable(const vector<int>& freqs, int num_symbols, int PROBABILITY_PRECISION, int MAX_STATE) {
-        //The encoding table is a matrix of size for efficient jumping between states
-        //e.g enc_table[0] is a vector of states assigned to symbol 0
-        vector<vector<int>> enc_table;
-        for (int i = 0; i < num_symbols; i++) {
-            vector<int> v{0};
-            enc_table.push_back(v);
-        }
-
-        //Sum of scaled up freqs, no symbol can reach this value
-        int sum_freqs = 1<<PROBABILITY_PRECISION;
-        vector<int> table = vector<int>(MAX_STATE+1, sum_freqs);
-
-        int state;
-        // The result of this loop is a list of consecutive states,
-        // the value of each state is a symbol
-
-        // also spread symbols at same time
-        for (int j = 1; j <= MAX_STATE; j++) {
-            for (int i = 0; i < num_symbols; i++) {
-                //making the input state to output state ratio (x'/x) as close to (1/P) as possible.
-                //http://cbloomrants.blogspot.com/2014/02/02-06-14-understanding-ans-8.html
-                state = max((j << PROBABILITY_PRECISION)/freqs[i], 2);
-                while (state <= MAX_STATE) {
-                    if (table[state] == sum_freqs) {
-                        table[state] = i;
-                        enc_table[i].push_back(state);
-                        break;
-                    }
-                    state++;
+    template <int K>
+    void DecodeStates(const vector<u8>& encoded_stream, const FSEDecodingTable& table, vector<u8>& decoded_stream,
+                      int byte_offset, const vector<int>& final_states) {
+        int table_size = 1 << table.table_log;
+        int offset[K];
+        for (int k = 0; k < K; k++) {
+            assert(final_states[k] >= table_size && final_states[k] < 2 * table_size);
+            offset[k] = final_states[k] - table_size;
+        }
+
+        BackwardBitReader reader(encoded_stream.data(), (int)encoded_stream.size(), byte_offset);
+        const DecodeEntry* entries = table.entries.data();
+        u8* out = decoded_stream.data();
+        auto decode = [&](int& x, int i) {
+            const DecodeEntry& entry = entries[x];
+            out[i] = entry.symbol;
+            x = entry.new_state + reader.read(entry.nb_bits);
+        };
+        // Undo the encoder's tail first, then whole groups of K symbols
+        int i = (int)decoded_stream.size() - 1;
+        for (; i >= 0 && (i + 1) % K != 0; i--) {
+            decode(offset[i % K], i);
+        }
+        for (; i >= 0; i -= K) {
+            for (int k = K - 1; k >= 0; k--) {
+                decode(offset[k], i - (K - 1 - k));
+            }
+        }
+    }
+
+    // EncodeStates with the table of each segment taken from selectors
+    template <int K>
+    void EncodeSegmentStates(const vector<uint8_t>& data, const vector<FSEEncodingTable>& tables,
+                             const vector<u8>& selectors, vector<u8>& encoded_stream, int& byte_offset,
+                             vector<int>& final_states) {
+        int data_size = (int)data.size();
+        int table_log = tables[0].table_log;
+        encoded_stream.resize((size_t)data_size * table_log / 8 + 16);
+        BitWriter writer(encoded_stream.data());
+
+        u32 state[K];
+        for (int k = 0; k < K; k++) {
+            state[k] = 1u << table_log;
+        }
+        // Segments hold whole groups of K symbols, only the last one can end
+        // with a partial group
+        for (int start = 0, segment = 0; start < data_size; start += FSE_SEGMENT_SIZE, segment++) {
+            const FSEEncodingTable& table = tables[selectors[segment]];
+            const SymbolTransform* symbol_tt = table.symbol_tt.data();
+            const u16* state_table = table.state_table.data();
+            auto encode = [&](u32& x, u8 symbol) {
+                const SymbolTransform& tt = symbol_tt[symbol];
+                int nb_bits = (int)((x + tt.delta_nb_bits) >> 16);
+                writer.write(x, nb_bits);
+                x = state_table[(int)(x >> nb_bits) + tt.delta_find_state];
+            };
+            int end = min(start + FSE_SEGMENT_SIZE, data_size);
+            int i = start;
+            for (; i + K <= end; i += K) {
+                for (int k = 0; k < K; k++) {
+                    encode(state[k], data[i + k]);
                 }
             }
+            for (; i < end; i++) {
+                encode(state[i % K], data[i]);
+            }
         }
-        return enc_table;
+
+        encoded_stream.resize(writer.finish(byte_offset));
+        final_states.assign(state, state + K);
     }
 
-    void CreateDecodingTable(const vector<vector<int>>& encoding_table, vector<int>& rev_sym_table, vector<int>& rev_sym_state, int num_symbols) {
-        for (int i = 0; i < num_symbols; i++) {
-            int j = 1;
-            int t_size = (int)encoding_table[i].size();
-            for (int k = 0; k < t_size - 1; k++) {
-                rev_sym_table[encoding_table[i][j]] = i;
-                rev_sym_state[encoding_table[i][j]] = k+1;
-                j++;
+    // DecodeStates with the table of each segment taken from selectors
+    template <int K>
+    void DecodeSegmentStates(const vector<u8>& encoded_stream, const vector<FSEDecodingTable>& tables,
+                             const vector<u8>& selectors, vector<u8>& decoded_stream, int byte_offset,
+                             const vector<int>& final_states) {
+        int table_size = 1 << tables[0].table_log;
+        int offset[K];
+        for (int k = 0; k < K; k++) {
+            assert(final_states[k] >= table_size && final_states[k] < 2 * table_size);
+            offset[k] = final_states[k] - table_size;
+        }
+
+        BackwardBitReader reader(encoded_stream.data(), (int)encoded_stream.size(), byte_offset);
+        u8* out = decoded_stream.data();
+        int data_size = (int)decoded_stream.size();
+        const DecodeEntry* entries = nullptr;
+        auto decode = [&](int& x, int i) {
+            const DecodeEntry& entry = entries[x];
+            out[i] = entry.symbol;
+            x = entry.new_state + reader.read(entry.nb_bits);
+        };
+        // The encoder's partial group is in the last segment, every other
+        // segment holds whole groups
+        int i = data_size - 1;
+        for (int segment = (data_size - 1) / FSE_SEGMENT_SIZE; segment >= 0; segment--) {
+            entries = tables[selectors[segment]].entries.data();
+            int start = segment * FSE_SEGMENT_SIZE;
+            for (; i >= start && (i + 1) % K != 0; i--) {
+                decode(offset[i % K], i);
+            }
+            for (; i >= start; i -= K) {
+                for (int k = K - 1; k >= 0; k--) {
+                    decode(offset[k], i - (K - 1 - k));
+                }
             }
         }
     }
@@ -108,101 +510,412 @@ public:
 
     }
 
-    bool Compress(const vector<uint8_t>& data, int num_symbols, vector<u8>& encoded_stream,
-                    vector<int>& freqs, int& byte_offset, int& final_state) {
+    // Normalized counts must sum to 1 << table_log
+    void BuildEncodingTable(const vector<int>& norm, int num_symbols, int table_log, FSEEncodingTable& table) {
+        int table_size = 1 << table_log;
+        const vector<u8>& table_symbol = SpreadTable(norm, num_symbols, table_log);
+
+        // States of each symbol, in table order, packed one symbol after another
+        vector<int> cumul(num_symbols + 1, 0);
+        for (int s = 0; s < num_symbols; s++) {
+            cumul[s+1] = cumul[s] + norm[s];
+        }
+        table.table_log = table_log;
+        table.state_table.resize(table_size);
+        for (int u = 0; u < table_size; u++) {
+            table.state_table[cumul[table_symbol[u]]++] = (u16)(table_size + u);
+        }
+
+        table.symbol_tt.resize(num_symbols);
+        int total = 0;
+        for (int s = 0; s < num_symbols; s++) {
+            SymbolTransform& tt = table.symbol_tt[s];
+            if (norm[s] == 0) {
+                // Never encoded
+                tt.delta_nb_bits = ((table_log + 1) << 16) - table_size;
+                tt.delta_find_state = 0;
+            } else {
+                // States x >> nb_bits land in [norm, 2 * norm)
+                int max_bits_out = table_log - (bitlen(norm[s] - 1) - 1);
+                if (norm[s] == 1) {
+                    max_bits_out = table_log;
+                }
+                int min_state_plus = norm[s] << max_bits_out;
+                tt.delta_nb_bits = (max_bits_out << 16) - min_state_plus;
+                tt.delta_find_state = total - norm[s];
+                total += norm[s];
+            }
+        }
+    }
+
+    void BuildDecodingTable(const vector<int>& norm, int num_symbols, int table_log, FSEDecodingTable& table) {
+        assert(table_log >= 1 && table_log <= FSE_MAX_TABLE_LOG);
+        int table_size = 1 << table_log;
+        const vector<u8>& table_symbol = SpreadTable(norm, num_symbols, table_log);
+
+        vector<int> symbol_next(norm.begin(), norm.begin() + num_symbols);
+        table.table_log = table_log;
+        table.entries.resize(table_size);
+        for (int u = 0; u < table_size; u++) {
+            int s = table_symbol[u];
+            int next_state = symbol_next[s]++;
+            int nb_bits = table_log - (bitlen(next_state) - 1);
+            table.entries[u] = DecodeEntry{(u16)((next_state << nb_bits) - table_size), (u8)s, (u8)nb_bits};
+        }
+    }
+
+    // Encodes data forward, the decoder walks it backward from final_states.
+    // With several states, symbol i is coded by state i % num_states; all of
+    // them share one bitstream but their table walks are independent, which
+    // lets the CPU overlap them. encoded_stream is overwritten.
+    void Encode(const vector<uint8_t>& data, const FSEEncodingTable& table, vector<u8>& encoded_stream,
+                int& byte_offset, vector<int>& final_states, int num_states = 1) {
+        switch (num_states) {
+            case 1: EncodeStates<1>(data, table, encoded_stream, byte_offset, final_states); break;
+            case 2: EncodeStates<2>(data, table, encoded_stream, byte_offset, final_states); break;
+            case 4: EncodeStates<4>(data, table, encoded_stream, byte_offset, final_states); break;
+            default: assert(false);
+        }
+    }
+
+    // The number of states is final_states.size()
+    void Decode(const vector<u8>& encoded_stream, const FSEDecodingTable& table, vector<u8>& decoded_stream,
+                int byte_offset, const vector<int>& final_states) {
+        switch (final_states.size()) {
+            case 1: DecodeStates<1>(encoded_stream, table, decoded_stream, byte_offset, final_states); break;
+            case 2: DecodeStates<2>(encoded_stream, table, decoded_stream, byte_offset, final_states); break;
+            case 4: DecodeStates<4>(encoded_stream, table, decoded_stream, byte_offset, final_states); break;
+            default: assert(false);
+        }
+    }
+
+    // Estimated coded size in bits of counts with the given normalization
+    double CodedBits(const vector<int>& counts, const vector<int>& norm, int table_log) {
+        double bits = 0;
+        for (size_t s = 0; s < counts.size(); s++) {
+            if (counts[s] > 0) {
+                bits += counts[s] * (table_log - log2(norm[s]));
+            }
+        }
+        return bits;
+    }
+
+    // Length of the Exp-Golomb code of order k of value: the bits of
+    // value + 2^k above the low k, in unary (zeros then a one), then those low bits
+    static int ExpGolombBits(u32 value, int k) {
+        int len = 32 - __builtin_clz(value + (1u << k));
+        return 2 * len - k - 1;
+    }
+
+    // Bits of the normalized counts in a compact header: each count as an
+    // Exp-Golomb code up to the one that brings the sum to 1 << table_log,
+    // the rest are 0 and left out. Returns the size with the order that
+    // makes it smallest, stored in k.
+    int CountsHeaderBits(const vector<int>& norm, int table_log, int& k) {
+        int L = 1 << table_log;
+        int best = -1;
+        k = 0;
+        for (int order = 0; order <= min(table_log, FSE_MAX_COUNT_ORDER); order++) {
+            int bits = 0, sum = 0;
+            for (size_t s = 0; s < norm.size() && sum < L; s++) {
+                bits += ExpGolombBits(norm[s], order);
+                sum += norm[s];
+            }
+            if (best < 0 || bits < best) {
+                best = bits;
+                k = order;
+            }
+        }
+        return best;
+    }
+
+    // Picks the table log for data with the given counts and returns its
+    // normalized counts. Candidates go from the smallest log that gives every
+    // present symbol a state up to params.max_table_log, but never far past
+    // what the block size can fill. The first one that codes within
+    // params.cost_tolerance of the empirical entropy wins, otherwise the one
+    // with the smallest estimated size, counting the compact header of the
+    // counts: small blocks are better off with a small table.
+    vector<int> ChooseTableLog(const vector<int>& counts, int total, const FSEParams& params, int& table_log) {
+        int present = 0;
+        double entropy = 0;
+        for (int c: counts) {
+            if (c > 0) {
+                present++;
+                entropy += c * log2((double)total / c);
+            }
+        }
+        int min_log = max(FSE_MIN_TABLE_LOG, bitlen(present - 1));
+        int max_log = min(params.max_table_log, FSE_MAX_TABLE_LOG);
+        max_log = min(max_log, max(bitlen(total - 1) - 2, FSE_MIN_TABLE_LOG));
+        max_log = max(max_log, min_log);
+
+        vector<int> best_norm;
+        double best_bits = 0;
+        for (int log = min_log; log <= max_log; log++) {
+            vector<int> norm = NormalizeCount(counts, total, log);
+            double bits = CodedBits(counts, norm, log);
+            int k;
+            double header_bits = CountsHeaderBits(norm, log, k);
+            if (best_norm.empty() || bits + header_bits < best_bits) {
+                best_norm = norm;
+                best_bits = bits + header_bits;
+                table_log = log;
+            }
+            if (bits <= entropy * (1 + params.cost_tolerance)) {
+                break;
+            }
+        }
+        return best_norm;
+    }
+
+    // Picks num_tables normalized tables with the given table log (raised
+    // when too small for the symbols present) and the
+    // table of each segment of data (selectors), the way bzip2 picks its
+    // Huffman tables: the tables start out favouring slices of the alphabet
+    // of equal weight, then each pass gives every segment to the table that
+    // codes it in the fewest bits and rebuilds each table from its segments.
+    // counts are the counts of the whole data. Every symbol present in data
+    // keeps a state in every table, so any segment can use any table.
+    void ChooseTables(const vector<u8>& data, const vector<int>& counts, int num_tables, int& table_log,
+                      int passes, vector<vector<int>>& norms, vector<u8>& selectors) {
+        int num_symbols = (int)counts.size();
+        int present = num_symbols - (int)count(counts.begin(), counts.end(), 0);
+        table_log = max(table_log, max(FSE_MIN_TABLE_LOG, bitlen(present - 1)));
         int data_size = (int)data.size();
-        int PROBABILITY_PRECISION = bitlen(num_symbols) + PRECISION;
-        int STATE_PRECISION = PROBABILITY_PRECISION + 1;
-        int MAX_STATE = (1<<STATE_PRECISION)-1;
+        int num_segments = (data_size + FSE_SEGMENT_SIZE - 1) / FSE_SEGMENT_SIZE;
+        assert(num_tables >= 1 && num_tables <= FSE_MAX_TABLES);
+
+        // Bits per symbol of each table, indexed [symbol * num_tables + table]
+        vector<float> cost((size_t)num_symbols * num_tables);
+        int remaining = data_size, first = 0;
+        for (int t = 0; t < num_tables; t++) {
+            int target = remaining / (num_tables - t), last = first - 1, weight = 0;
+            while (weight < target && last < num_symbols - 1) {
+                weight += counts[++last];
+            }
+            for (int s = 0; s < num_symbols; s++) {
+                cost[s * num_tables + t] = s >= first && s <= last ? 0 : 15;
+            }
+            first = last + 1;
+            remaining -= weight;
+        }
+
+        norms.assign(num_tables, vector<int>());
+        selectors.resize(num_segments);
+        vector<int> table_counts;
+        for (int pass = 0; pass < passes; pass++) {
+            table_counts.assign((size_t)num_tables * num_symbols, 0);
+            for (int segment = 0; segment < num_segments; segment++) {
+                int start = segment * FSE_SEGMENT_SIZE, end = min(start + FSE_SEGMENT_SIZE, data_size);
+                float bits[FSE_MAX_TABLES] = {0};
+                for (int i = start; i < end; i++) {
+                    const float* symbol_cost = &cost[data[i] * num_tables];
+                    for (int t = 0; t < num_tables; t++) {
+                        bits[t] += symbol_cost[t];
+                    }
+                }
+                int best = (int)(min_element(bits, bits + num_tables) - bits);
+                selectors[segment] = (u8)best;
+                int* counts_of_best = &table_counts[(size_t)best * num_symbols];
+                for (int i = start; i < end; i++) {
+                    counts_of_best[data[i]]++;
+                }
+            }
+            for (int t = 0; t < num_tables; t++) {
+                vector<int> table(table_counts.begin() + (size_t)t * num_symbols,
+                                  table_counts.begin() + (size_t)(t + 1) * num_symbols);
+                int total = 0;
+                for (int s = 0; s < num_symbols; s++) {
+                    table[s] = counts[s] > 0 ? max(table[s], 1) : 0;
+                    total += table[s];
+                }
+                norms[t] = NormalizeCount(table, total, table_log);
+                for (int s = 0; s < num_symbols; s++) {
+                    cost[s * num_tables + t] = norms[t][s] > 0 ? (float)(table_log - log2(norms[t][s])) : 0;
+                }
+            }
+        }
+    }
+
+    // Static tables for a dictionary: groups the samples (symbol counts of
+    // whole blocks) into at most num_tables clusters
+    // and returns the normalized counts of each non-empty one. Like
+    // ChooseTables with samples for segments: the samples start out sorted by
+    // their share of symbols 0 and 1 (the zero runs) and cut into groups of
+    // equal weight, then each pass gives every sample to the table that codes
+    // it in the fewest bits and rebuilds the tables. Every symbol seen in any
+    // sample keeps a state in every table, table_log is raised if needed.
+    vector<vector<int>> TrainTables(const vector<vector<int>>& samples, int num_tables, int& table_log, int passes) {
+        int num_symbols = 0;
+        for (const vector<int>& sample: samples) {
+            for (int s = (int)sample.size() - 1; s >= num_symbols; s--) {
+                if (sample[s] > 0) {
+                    num_symbols = s + 1;
+                }
+            }
+        }
+        vector<vector<int>> norms;
+        if (num_symbols == 0) {
+            return norms;
+        }
+        table_log = max(table_log, max(FSE_MIN_TABLE_LOG, bitlen(num_symbols - 1)));
+        int num_samples = (int)samples.size();
+        num_tables = max(1, min(num_tables, num_samples));
+
+        vector<long long> totals(num_samples, 0);
+        vector<int> order(num_samples);
+        vector<double> runs(num_samples, 0);
+        long long total_weight = 0;
+        for (int i = 0; i < num_samples; i++) {
+            for (int c: samples[i]) {
+                totals[i] += c;
+            }
+            if (totals[i] > 0) {
+                runs[i] = (double)(samples[i][0] + (samples[i].size() > 1 ? samples[i][1] : 0)) / totals[i];
+            }
+            total_weight += totals[i];
+            order[i] = i;
+        }
+        stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return runs[a] < runs[b];
+        });
+        vector<int> assignment(num_samples);
+        long long weight = 0;
+        for (int i: order) {
+            assignment[i] = (int)min<long long>(num_tables - 1, weight * num_tables / max(total_weight, 1LL));
+            weight += totals[i];
+        }
 
-        // Collect prob distribution and scale up the freqs
-        freqs = NormalizeCount(data, num_symbols, PROBABILITY_PRECISION);
-
-        // Create encoding table
-        vector<vector<int>> encoding_table = CreateEncodingTable(freqs, num_symbols, PROBABILITY_PRECISION, MAX_STATE);
-
-        bool success = true;
-
-        // Start encoding
-        int state = MAX_STATE;
-        unsigned char byte = 0;
-        unsigned char bit  = 0;
-        int control_MASK = 1 << (STATE_PRECISION-1);
-        for (int i=0; i<data_size; ++i) {
-            int t_size = (int)encoding_table[data[i]].size();
-            // shift and output bits while finding the range
-            while (state > t_size - 1) {
-                ++bit;
-                byte |= state & 1;
-                if (bit == 8) {
-                    encoded_stream.push_back(byte);
-                    bit = 0;
-                    byte = 0;
+        for (int pass = 0; pass <= passes; pass++) {
+            vector<vector<long long>> table_counts(num_tables, vector<long long>(num_symbols, 0));
+            for (int i = 0; i < num_samples; i++) {
+                for (int s = 0; s < (int)samples[i].size() && s < num_symbols; s++) {
+                    table_counts[assignment[i]][s] += samples[i][s];
                 }
-                else {
-                    byte <<=1;
+            }
+            norms.clear();
+            for (int t = 0; t < num_tables; t++) {
+                // Scaled down to int, then every symbol gets at least one
+                long long largest = *max_element(table_counts[t].begin(), table_counts[t].end());
+                long long divisor = largest / (1 << 24) + 1;
+                vector<int> counts(num_symbols);
+                int total = 0;
+                for (int s = 0; s < num_symbols; s++) {
+                    counts[s] = max((int)(table_counts[t][s] / divisor), 1);
+                    total += counts[s];
                 }
-                state >>= 1;
+                norms.push_back(NormalizeCount(counts, total, table_log));
             }
-            // Move to next state
-            state = encoding_table[data[i]][state];
-            if (state < control_MASK) {
-                cerr<<"FSE output error"<<endl;
-                success = false;
+            if (pass == passes) {
                 break;
             }
+            bool changed = false;
+            for (int i = 0; i < num_samples; i++) {
+                int best = assignment[i];
+                double best_bits = CodedBits(samples[i], norms[best], table_log);
+                for (int t = 0; t < num_tables; t++) {
+                    double bits = CodedBits(samples[i], norms[t], table_log);
+                    if (bits < best_bits) {
+                        best = t;
+                        best_bits = bits;
+                    }
+                }
+                changed |= best != assignment[i];
+                assignment[i] = best;
+            }
+            if (!changed) {
+                break;
+            }
+        }
+        // Tables no sample picked
+        vector<bool> used(num_tables, false);
+        for (int t: assignment) {
+            used[t] = true;
+        }
+        vector<vector<int>> result;
+        for (int t = 0; t < num_tables; t++) {
+            if (used[t]) {
+                result.push_back(norms[t]);
+            }
         }
+        return result;
+    }
 
-        // Remark where we stopped
-        if (bit == 0) {
-            byte_offset = 0;
+    // Encode with the table of segment j given by selectors[j]
+    void EncodeSegments(const vector<uint8_t>& data, const vector<FSEEncodingTable>& tables,
+                        const vector<u8>& selectors, vector<u8>& encoded_stream, int& byte_offset,
+                        vector<int>& final_states, int num_states = 1) {
+        switch (num_states) {
+            case 1: EncodeSegmentStates<1>(data, tables, selectors, encoded_stream, byte_offset, final_states); break;
+            case 2: EncodeSegmentStates<2>(data, tables, selectors, encoded_stream, byte_offset, final_states); break;
+            case 4: EncodeSegmentStates<4>(data, tables, selectors, encoded_stream, byte_offset, final_states); break;
+            default: assert(false);
         }
-        else {
-            // Flush out this last byte
-            byte_offset = 8 - bit;
-            encoded_stream.push_back(byte << (7 - bit));
+    }
+
+    void DecodeSegments(const vector<u8>& encoded_stream, const vector<FSEDecodingTable>& tables,
+                        const vector<u8>& selectors, vector<u8>& decoded_stream, int byte_offset,
+                        const vector<int>& final_states) {
+        switch (final_states.size()) {
+            case 1: DecodeSegmentStates<1>(encoded_stream, tables, selectors, decoded_stream, byte_offset, final_states); break;
+            case 2: DecodeSegmentStates<2>(encoded_stream, tables, selectors, decoded_stream, byte_offset, final_states); break;
+            case 4: DecodeSegmentStates<4>(encoded_stream, tables, selectors, decoded_stream, byte_offset, final_states); break;
+            default: assert(false);
         }
+    }
 
-        // State of the whole message
-        final_state = state;
+    // FSE-encodes data with num_states interleaved states (1, 2 or 4),
+    // choosing the table log and normalized counts (freqs) from params.
+    void Compress(const vector<uint8_t>& data, int num_symbols, vector<u8>& encoded_stream,
+                  vector<int>& freqs, int& table_log, int& byte_offset, vector<int>& final_states,
+                  const FSEParams& params, int num_states = 1) {
+        vector<int> counts(num_symbols, 0);
+        for (u8 symbol: data) {
+            counts[symbol]++;
+        }
+        freqs = ChooseTableLog(counts, (int)data.size(), params, table_log);
 
-        return success;
+        FSEEncodingTable table;
+        BuildEncodingTable(freqs, num_symbols, table_log, table);
+        Encode(data, table, encoded_stream, byte_offset, final_states, num_states);
     }
 
     void Decompress(const vector<u8>& encoded_stream, const vector<int>& freqs, vector<u8>& decoded_stream,
+                    int table_log, int byte_offset, const vector<int>& final_states) {
+        FSEDecodingTable table;
+        BuildDecodingTable(freqs, (int)freqs.size(), table_log, table);
+        Decode(encoded_stream, table, decoded_stream, byte_offset, final_states);
+    }
+
+    // Decodes a block written by the original FSE_MODE encoder. Returns false
+    // when the state leaves the table, which only corrupt counts lead to.
+    bool DecompressLegacy(const vector<u8>& encoded_stream, const vector<int>& freqs, vector<u8>& decoded_stream,
                     int byte_offset, int state, int num_symbols) {
 
         int PROBABILITY_PRECISION = bitlen(num_symbols) + PRECISION;
         int STATE_PRECISION = PROBABILITY_PRECISION + 1;
         int MAX_STATE = (1<<STATE_PRECISION)-1;
+        int L = 1 << PROBABILITY_PRECISION;
+        if (state < L || state > MAX_STATE) {
+            return false;
+        }
 
-        vector<vector<int>> encoding_table = CreateEncodingTable(freqs, num_symbols, PROBABILITY_PRECISION, MAX_STATE);
-
-        // Creating a decoding table
-        vector<int> rev_symbol_table(MAX_STATE+1);
-        vector<int> rev_symbol_state(MAX_STATE+1);
-        CreateDecodingTable(encoding_table, rev_symbol_table, rev_symbol_state, num_symbols);
+        vector<DecodeEntry> table = CreateLegacyDecodingTable(freqs, num_symbols, PROBABILITY_PRECISION, MAX_STATE);
 
-        // Start decoding
-        int MASK = 1<<(STATE_PRECISION-1);
-        unsigned char shift = byte_offset;
-        // Counter is the index of current processing encoded byte,
-        // it goes backward from the end to the beginning.
-        int counter = (int)encoded_stream.size() - 1;
+        // Start decoding, backward from the last symbol
+        BackwardBitReader reader(encoded_stream.data(), (int)encoded_stream.size(), byte_offset, true);
+        int offset = state - L;
         for (int i = (int)decoded_stream.size() - 1; i >= 0; --i) {
-            decoded_stream[i] = rev_symbol_table[state];
-            state = rev_symbol_state[state];
-            // Renorm to the range
-            while (state < MASK) {
-                state <<= 1;
-                // Keep shifting and consuming bits until we are in range
-                state |= (encoded_stream[counter] & (1<<shift))>>shift;
-                ++shift;
-                if (shift == 8) {
-                    shift = 0;
-                    --counter;
-                }
+            if (offset >= L) {
+                return false;
             }
+            const DecodeEntry& entry = table[offset];
+            decoded_stream[i] = entry.symbol;
+            offset = entry.new_state + reader.read(entry.nb_bits);
         }
+        return true;
     }
 };
+
+#endif
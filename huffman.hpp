@@ -0,0 +1,326 @@
+//
+//  huffman.hpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+// Length-limited canonical Huffman coder, an alternative to FSE for blocks
+// where decoding speed matters more than the last fraction of a percent.
+
+#ifndef HUFFMAN_HPP
+#define HUFFMAN_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+#include "fse.hpp"
+
+using namespace std;
+
+// Longest code length, the decoder looks codes up with at most this many bits
+const int HUF_MAX_BITS = 11;
+
+// Reads an LSB-first bitstream (as written by BitWriter) from its start.
+// Bits past the end read as zeros.
+class ForwardBitReader {
+public:
+    ForwardBitReader(const u8* data, int size): data{data}, size{size}, pos{0}, consumed{0} {
+        reload();
+    }
+
+    // Look at the next num_bits bits without consuming them
+    u32 peek(int num_bits) const {
+        return (u32)(container >> consumed) & ((1u << num_bits) - 1);
+    }
+
+    void skip(int num_bits) {
+        consumed += num_bits;
+    }
+
+    // Make at least 56 bits available to peek
+    void reload() {
+        pos += consumed >> 3;
+        consumed &= 7;
+        // (assumes a little-endian host)
+        if (pos + 8 <= size) {
+            memcpy(&container, data + pos, 8);
+        } else {
+            container = 0;
+            for (int i = pos; i < size; i++) {
+                container |= (u64)data[i] << (8 * (i - pos));
+            }
+        }
+    }
+
+private:
+    const u8* data;
+    int size;
+    int pos;
+    int consumed;
+    u64 container;
+};
+
+// Decodes up to two symbols from one lookup
+struct HuffmanDecodeEntry {
+    u8 symbols[2];
+    u8 num_symbols;
+    u8 nb_bits;
+};
+
+struct HuffmanDecodingTable {
+    // Bits per lookup, the longest code length: the tables of a small block
+    // with short codes are small and quick to build
+    int table_bits;
+    vector<HuffmanDecodeEntry> single;
+    vector<HuffmanDecodeEntry> pairs;
+};
+
+class Huffman {
+private:
+    // Code lengths of a plain Huffman tree, built by repeatedly merging the
+    // two lightest nodes of a two-queue (leaves sorted by count, then merged
+    // nodes in creation order).
+    vector<int> TreeLengths(const vector<int>& counts) {
+        int num_symbols = (int)counts.size();
+        vector<int> leaves;
+        for (int s = 0; s < num_symbols; s++) {
+            if (counts[s] > 0) {
+                leaves.push_back(s);
+            }
+        }
+        vector<int> lengths(num_symbols, 0);
+        if (leaves.size() == 1) {
+            lengths[leaves[0]] = 1;
+            return lengths;
+        }
+        stable_sort(leaves.begin(), leaves.end(), [&](int a, int b) { return counts[a] < counts[b]; });
+
+        int n = (int)leaves.size();
+        // Nodes 0..n-1 are leaves, n.. are merged nodes
+        vector<long long> weight(2 * n - 1);
+        vector<int> parent(2 * n - 1, -1);
+        for (int i = 0; i < n; i++) {
+            weight[i] = counts[leaves[i]];
+        }
+        int next_leaf = 0, next_node = n, created = n;
+        auto pop_lightest = [&]() {
+            if (next_leaf < n && (next_node >= created || weight[next_leaf] <= weight[next_node])) {
+                return next_leaf++;
+            }
+            return next_node++;
+        };
+        while (created < 2 * n - 1) {
+            int a = pop_lightest();
+            int b = pop_lightest();
+            weight[created] = weight[a] + weight[b];
+            parent[a] = parent[b] = created;
+            created++;
+        }
+        // Depths, parents always come after their children
+        vector<int> depth(2 * n - 1, 0);
+        for (int i = 2 * n - 3; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+        }
+        for (int i = 0; i < n; i++) {
+            lengths[leaves[i]] = depth[i];
+        }
+        return lengths;
+    }
+
+public:
+    Huffman() {
+
+    }
+
+    // Code lengths for counts, none longer than max_bits. Over-long codes are
+    // clamped, then the Kraft sum is brought back to at most 1 by lengthening
+    // the longest codes that are still short enough, and any slack left is
+    // spent on shortening the most frequent symbols.
+    vector<int> BuildCodeLengths(const vector<int>& counts, int max_bits) {
+        vector<int> lengths = TreeLengths(counts);
+        int num_symbols = (int)counts.size();
+
+        // Kraft sum in units of 2^-max_bits
+        long long kraft = 0;
+        const long long one = 1LL << max_bits;
+        for (int s = 0; s < num_symbols; s++) {
+            if (lengths[s] > max_bits) {
+                lengths[s] = max_bits;
+            }
+            if (lengths[s] > 0) {
+                kraft += 1LL << (max_bits - lengths[s]);
+            }
+        }
+        if (kraft <= one) {
+            return lengths;
+        }
+
+        vector<int> order;
+        for (int s = 0; s < num_symbols; s++) {
+            if (lengths[s] > 0) {
+                order.push_back(s);
+            }
+        }
+        // Least frequent first
+        stable_sort(order.begin(), order.end(), [&](int a, int b) { return counts[a] < counts[b]; });
+        while (kraft > one) {
+            for (int len = max_bits - 1; len > 0 && kraft > one; len--) {
+                for (int s: order) {
+                    if (lengths[s] == len) {
+                        lengths[s]++;
+                        kraft -= 1LL << (max_bits - len - 1);
+                        break;
+                    }
+                }
+            }
+        }
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            int s = *it;
+            while (lengths[s] > 1 && kraft + (1LL << (max_bits - lengths[s])) <= one) {
+                kraft += 1LL << (max_bits - lengths[s]);
+                lengths[s]--;
+            }
+        }
+        return lengths;
+    }
+
+    // Canonical codes, bit-reversed so that the first bit of a code is the
+    // first one BitWriter writes
+    vector<u32> CanonicalCodes(const vector<int>& lengths) {
+        int num_symbols = (int)lengths.size();
+        vector<int> count_per_length(HUF_MAX_BITS + 2, 0);
+        for (int len: lengths) {
+            count_per_length[len]++;
+        }
+        count_per_length[0] = 0;
+        vector<u32> next_code(HUF_MAX_BITS + 2, 0);
+        u32 code = 0;
+        for (int len = 1; len <= HUF_MAX_BITS; len++) {
+            code = (code + count_per_length[len - 1]) << 1;
+            next_code[len] = code;
+        }
+        vector<u32> codes(num_symbols, 0);
+        for (int s = 0; s < num_symbols; s++) {
+            int len = lengths[s];
+            if (len == 0) {
+                continue;
+            }
+            u32 c = next_code[len]++;
+            u32 reversed = 0;
+            for (int i = 0; i < len; i++) {
+                reversed |= ((c >> i) & 1) << (len - 1 - i);
+            }
+            codes[s] = reversed;
+        }
+        return codes;
+    }
+
+    // Size in bits of data coded with lengths
+    long long CodedBits(const vector<int>& counts, const vector<int>& lengths) {
+        long long bits = 0;
+        for (size_t s = 0; s < counts.size(); s++) {
+            bits += (long long)counts[s] * lengths[s];
+        }
+        return bits;
+    }
+
+    // encoded_stream is overwritten
+    void Encode(const vector<u8>& data, const vector<int>& lengths, vector<u8>& encoded_stream) {
+        vector<u32> codes = CanonicalCodes(lengths);
+        encoded_stream.resize(data.size() * HUF_MAX_BITS / 8 + 16);
+        BitWriter writer(encoded_stream.data());
+        for (u8 symbol: data) {
+            writer.write(codes[symbol], lengths[symbol]);
+        }
+        int unused_bits;
+        encoded_stream.resize(writer.finish(unused_bits));
+    }
+
+    // Lookup tables over the longest code length (at most HUF_MAX_BITS). A
+    // pairs entry holds the first symbol and, when its code also fits in the
+    // remaining bits, the second one. The pairs table is left empty when
+    // fewer symbols than its entries will be decoded (building it would cost
+    // more than it saves). table is overwritten.
+    void BuildDecodingTable(const vector<int>& lengths, HuffmanDecodingTable& table, size_t decoded_size) {
+        int table_bits = max(1, *max_element(lengths.begin(), lengths.end()));
+        assert(table_bits <= HUF_MAX_BITS);
+        int table_size = 1 << table_bits;
+        vector<u32> codes = CanonicalCodes(lengths);
+        table.table_bits = table_bits;
+        // Entries no code reaches only come up in corrupt streams, they still
+        // consume table_bits so the reader stays within its reload budget
+        table.single.assign(table_size, HuffmanDecodeEntry{{0, 0}, 1, (u8)table_bits});
+        for (size_t s = 0; s < lengths.size(); s++) {
+            int len = lengths[s];
+            if (len == 0) {
+                continue;
+            }
+            for (u32 idx = codes[s]; idx < (u32)table_size; idx += 1u << len) {
+                table.single[idx] = HuffmanDecodeEntry{{(u8)s, 0}, 1, (u8)len};
+            }
+        }
+
+        if (decoded_size < (size_t)table_size) {
+            table.pairs.clear();
+            return;
+        }
+        table.pairs = table.single;
+        for (int idx = 0; idx < table_size; idx++) {
+            HuffmanDecodeEntry& entry = table.pairs[idx];
+            int first_bits = entry.nb_bits;
+            if (first_bits >= table_bits) {
+                continue;
+            }
+            const HuffmanDecodeEntry& second = table.single[idx >> first_bits];
+            if (first_bits + second.nb_bits <= table_bits) {
+                entry.symbols[1] = second.symbols[0];
+                entry.num_symbols = 2;
+                entry.nb_bits = (u8)(first_bits + second.nb_bits);
+            }
+        }
+    }
+
+    HuffmanDecodingTable BuildDecodingTable(const vector<int>& lengths) {
+        HuffmanDecodingTable table;
+        BuildDecodingTable(lengths, table, SIZE_MAX);
+        return table;
+    }
+
+    // decoded_stream must already have the decoded size
+    void Decode(const vector<u8>& encoded_stream, const HuffmanDecodingTable& table, vector<u8>& decoded_stream) {
+        ForwardBitReader reader(encoded_stream.data(), (int)encoded_stream.size());
+        const HuffmanDecodeEntry* pairs = table.pairs.empty() ? table.single.data() : table.pairs.data();
+        int table_bits = table.table_bits;
+        u8* out = decoded_stream.data();
+        int size = (int)decoded_stream.size();
+        int i = 0;
+        // 5 lookups of at most HUF_MAX_BITS bits fit in one reload
+        while (i + 10 <= size) {
+            for (int k = 0; k < 5; k++) {
+                const HuffmanDecodeEntry& entry = pairs[reader.peek(table_bits)];
+                out[i] = entry.symbols[0];
+                out[i + 1] = entry.symbols[1];
+                i += entry.num_symbols;
+                reader.skip(entry.nb_bits);
+            }
+            reader.reload();
+        }
+        // Tail, one symbol at a time so nothing is written past the end
+        while (i < size) {
+            const HuffmanDecodeEntry& entry = table.single[reader.peek(table_bits)];
+            out[i++] = entry.symbols[0];
+            reader.skip(entry.nb_bits);
+            reader.reload();
+        }
+    }
+
+    vector<u8> Decompress(const vector<u8>& encoded_stream, const vector<int>& lengths, int decoded_size) {
+        vector<u8> decoded_stream(decoded_size);
+        Decode(encoded_stream, BuildDecodingTable(lengths), decoded_stream);
+        return decoded_stream;
+    }
+};
+
+#endif
@@ -15,7 +15,10 @@
 #define INPUT_STREAM_HPP
 
 #include <iostream>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <vector>
 
 /* These definitions are more reliable for fixed width types than using "int" and assuming its width */
 using u8 = std::uint8_t;
@@ -25,10 +28,21 @@ using u64 = std::uint64_t;
 
 
 
+/* Bytes are read from the istream with one read() call per BUFFER_SIZE
+   bytes and bits are taken LSB first from a 64 bit accumulator. The stream
+   reads ahead, so the istream should not be used directly while an
+   InputBitStream is attached to it; use read_span instead.
+   A stream can also read straight from memory (e.g. a mapped file), which
+   then serves as the buffer. */
 class InputBitStream{
 public:
     /* Constructor */
-    InputBitStream( std::istream& input_stream ): bitvec{0}, numbits{8}, infile{input_stream}, done{false}, last_real_bit{0} {
+    InputBitStream( std::istream& input_stream ): bitvec{0}, numbits{0}, storage(BUFFER_SIZE), buffer{storage.data()}, buffer_pos{0}, buffer_end{0}, infile{&input_stream}, done{false}, last_real_bit{0}, past_end{false} {
+
+    }
+
+    /* Read from size bytes at data, which must outlive the stream */
+    InputBitStream( const u8* data, size_t size ): bitvec{0}, numbits{0}, buffer{data}, buffer_pos{0}, buffer_end{size}, infile{nullptr}, done{true}, last_real_bit{0}, past_end{false} {
 
     }
 
@@ -38,64 +52,161 @@ public:
 
     /* Read an entire byte from the stream, with the least significant bit read first */
     unsigned char read_byte(){
+        if (numbits == 0 && buffer_pos < buffer_end){
+            unsigned char b = buffer[buffer_pos++];
+            last_real_bit = b>>7;
+            return b;
+        }
         return read_bits(8);
     }
 
     /* Push a 32 bit unsigned integer value (LSB first) */
     u32 read_u32(){
-        return read_bits(8) | (read_bits(8)<<8) | (read_bits(8)<<16) | (read_bits(8)<<24);
+        return read_bits(32);
+    }
+
+    /* Read a 64 bit unsigned integer value (LSB first) */
+    u64 read_u64(){
+        u64 low = read_bits(32);
+        return low | (u64)read_bits(32)<<32;
     }
 
     /* Push a 16 bit unsigned short value (LSB first) */
     u16 read_u16(){
-        return read_bits(8) | (read_bits(8)<<8);
+        return read_bits(16);
+    }
+
+    /* Read an integer written by OutputBitStream::push_varint (at most 5 bytes) */
+    u32 read_varint(){
+        u32 value = 0;
+        for (int shift = 0; shift < 35; shift += 7){
+            unsigned char b = read_byte();
+            value |= (u32)(b & 0x7F)<<shift;
+            if (!(b & 0x80))
+                break;
+        }
+        return value;
+    }
+
+    /* Read size bytes into data. Byte aligned reads copy out of the buffer
+       and take large remainders straight from the istream; bytes past the
+       end of the input read like read_byte past the end. */
+    void read_span(u8* data, size_t size){
+        size_t copied = 0;
+        if (numbits % 8 == 0){
+            // Whole bytes still in the accumulator come first
+            while (numbits > 0 && copied < size)
+                data[copied++] = read_bits(8);
+            size_t n = std::min(size - copied, buffer_end - buffer_pos);
+            std::memcpy(data + copied, buffer + buffer_pos, n);
+            buffer_pos += n;
+            copied += n;
+            if (size - copied >= BUFFER_SIZE && !done){
+                infile->read((char*)data + copied, size - copied);
+                copied += infile->gcount();
+            }
+            if (copied > 0)
+                last_real_bit = data[copied - 1]>>7;
+        }
+        while (copied < size)
+            data[copied++] = read_bits(8);
+    }
+
+    /* For streams reading from memory: return a pointer to the next size
+       bytes and skip over them. Returns nullptr (and reads nothing) when the
+       stream reads from an istream, is not byte aligned or has fewer bytes left. */
+    const u8* map_span(size_t size){
+        if (infile || numbits % 8 != 0 || past_end)
+            return nullptr;
+        //Bytes already moved into the accumulator are given back
+        size_t pos = buffer_pos - numbits/8;
+        if (size > buffer_end - pos)
+            return nullptr;
+        bitvec = 0;
+        numbits = 0;
+        buffer_pos = pos + size;
+        if (size > 0)
+            last_real_bit = buffer[buffer_pos - 1]>>7;
+        return buffer + pos;
     }
 
-    /* Read the lowest order num_bits bits from the stream into a u32,
+    /* Read the lowest order num_bits bits (at most 32) from the stream into a u32,
        with the least significant bit read first.
     */
     u32 read_bits(int num_bits){
-        u32 result{};
-        for (int i = 0; i < num_bits; i++)
-            result |= read_bit()<<i;
+        if (numbits < (u32)num_bits)
+            refill();
+        if (numbits < (u32)num_bits){
+            //This has been set up to emit an infinite number of copies
+            //of the last bit once EOF is reached (so if the last bit
+            //in the file is a 1, any subsequent call to read_bit will
+            //return 1).
+            u64 padding = last_real_bit ? ~(u64)0 : 0;
+            bitvec |= padding<<numbits;
+            numbits = 64;
+            past_end = true;
+        }
+        u32 result = (u32)(bitvec & (((u64)1<<num_bits) - 1));
+        bitvec >>= num_bits;
+        numbits -= num_bits;
+        last_real_bit = (result>>(num_bits - 1))&0x1;
         return result;
     }
 
     /* Read a single bit b (stored as the LSB of an unsigned int)
        from the stream */
     unsigned int read_bit(){
-        //This has been set up to emit an infinite number of copies
-        //of the last bit once EOF is reached (so if the last bit
-        //in the file is a 1, any subsequent call to read_bit will
-        //return 1).
-        if (numbits == 8)
-            input_byte();
-        if (!done)
-            last_real_bit = (bitvec>>(numbits++))&0x1;
-        
-        return last_real_bit;
+        return read_bits(1);
+    }
+
+    /* True once a read has gone past the end of the input and been padded */
+    bool read_past_end() const{
+        return past_end;
     }
 
     /* Flush the currently stored bits to the output stream */
     void flush_to_byte(){
-        numbits = 8; //Force the next read to read a byte from the input file
+        //Drop the rest of the current byte
+        u32 extra = numbits % 8;
+        bitvec >>= extra;
+        numbits -= extra;
     }
 private:
-    void input_byte(){
-        char c;
-        if (!infile.get(c)){
+    static const size_t BUFFER_SIZE = 1<<16;
+
+    /* Move whole bytes from the buffer into the accumulator until it holds
+       more than 56 bits or the input runs out */
+    void refill(){
+        while (numbits <= 56){
+            if (buffer_pos == buffer_end && !fill_buffer())
+                return;
+            bitvec |= (u64)buffer[buffer_pos++]<<numbits;
+            numbits += 8;
+        }
+    }
+
+    bool fill_buffer(){
+        if (done)
+            return false;
+        infile->read((char*)storage.data(), BUFFER_SIZE);
+        buffer_pos = 0;
+        buffer_end = infile->gcount();
+        if (buffer_end == 0){
             done = true;
-            numbits = 0;
-            return;
+            return false;
         }
-        bitvec = (unsigned char)c;
-        numbits = 0;
+        return true;
     }
-    u32 bitvec;
+    u64 bitvec;
     u32 numbits;
-    std::istream& infile;
+    std::vector<u8> storage;
+    const u8* buffer;
+    size_t buffer_pos;
+    size_t buffer_end;
+    std::istream* infile;
     bool done;
     unsigned int last_real_bit;
+    bool past_end;
 };
 
 
@@ -0,0 +1,160 @@
+//
+//  mapped_file.hpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Whole file mapped read-only. Files that cannot be mapped (pipes, ...)
+// are read into memory instead. Check is_open() after construction.
+class MappedFile {
+public:
+    MappedFile(const std::string& path): fd{-1}, map{nullptr}, map_size{0}, mapped{false} {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close_file();
+            return;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            read_all();
+            return;
+        }
+        map_size = (size_t)st.st_size;
+        // A zero length mapping is not allowed, an empty file just has no data
+        if (map_size > 0) {
+            void* p = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                read_all();
+                return;
+            }
+            map = (const uint8_t*)p;
+            mapped = true;
+            madvise(p, map_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    ~MappedFile() {
+        if (mapped) {
+            munmap((void*)map, map_size);
+        }
+        close_file();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    const uint8_t* data() const {
+        return map;
+    }
+
+    size_t size() const {
+        return map_size;
+    }
+
+private:
+    void read_all() {
+        uint8_t chunk[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+            contents.insert(contents.end(), chunk, chunk + n);
+        }
+        if (n < 0) {
+            close_file();
+            return;
+        }
+        map = contents.data();
+        map_size = contents.size();
+    }
+
+    void close_file() {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+    }
+
+    int fd;
+    const uint8_t* map;
+    size_t map_size;
+    bool mapped;
+    std::vector<uint8_t> contents;
+};
+
+// Output file created (or truncated) with its final size and written
+// through a shared mapping. Check is_open() after construction.
+class MappedOutputFile {
+public:
+    MappedOutputFile(const std::string& path, size_t size): fd{-1}, map{nullptr}, map_size{size} {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return;
+        }
+        if (ftruncate(fd, (off_t)size) != 0) {
+            close_file();
+            return;
+        }
+        if (size > 0) {
+            void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                close_file();
+                return;
+            }
+            map = (uint8_t*)p;
+        }
+    }
+
+    ~MappedOutputFile() {
+        if (map) {
+            munmap(map, map_size);
+        }
+        close_file();
+    }
+
+    MappedOutputFile(const MappedOutputFile&) = delete;
+    MappedOutputFile& operator=(const MappedOutputFile&) = delete;
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    uint8_t* data() {
+        return map;
+    }
+
+    size_t size() const {
+        return map_size;
+    }
+
+private:
+    void close_file() {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+    }
+
+    int fd;
+    uint8_t* map;
+    size_t map_size;
+};
+
+#endif
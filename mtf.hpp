@@ -6,41 +6,192 @@
 //  Copyright © 2020 Phuc Nguyen. All rights reserved.
 //
 
-#include "linked_list.hpp"
-#include <deque>
+#ifndef MTF_HPP
+#define MTF_HPP
+
+#include <vector>
+#include <cstring>
+#include <cassert>
 #include <iostream>
 
 using namespace std;
 
-vector<uint8_t> MTF_encode(const vector<uint8_t>& input) {
-    list dict;
-    //Establish the list
-    for (size_t i = 0; i < 256; i++) {
-        dict.insert_back((uint8_t)i);
+// Both directions keep the recency order in a 256-byte array. Most ranks
+// after a BWT are 0 or 1 and are handled without touching the rest of the
+// array; otherwise the symbol is found with memchr and the prefix shifted
+// with memmove, both vectorized by the C library.
+
+inline vector<uint8_t> MTF_encode(const vector<uint8_t>& input) {
+    uint8_t order[256];
+    for (int i = 0; i < 256; i++) {
+        order[i] = (uint8_t)i;
     }
 
-    vector<uint8_t> res(input.size());
-    for (size_t i = 0; i < input.size(); i++) {
-        int dist = dict.move_to_front(input[i]);
-        res[i] = dist;
+    size_t size = input.size();
+    vector<uint8_t> res(size);
+    for (size_t i = 0; i < size; i++) {
+        uint8_t c = input[i];
+        if (order[0] == c) {
+            res[i] = 0;
+        } else if (order[1] == c) {
+            order[1] = order[0];
+            order[0] = c;
+            res[i] = 1;
+        } else {
+            int rank = (int)((const uint8_t*)memchr(order + 2, c, 254) - order);
+            memmove(order + 1, order, rank);
+            order[0] = c;
+            res[i] = (uint8_t)rank;
+        }
     }
 
     return res;
 }
 
-vector<uint8_t> MTF_decode(const vector<uint8_t>& input) {
-    deque<uint8_t> dict;
-    //Establish the list
-    for (size_t i = 0; i < 256; i++) {
-        dict.push_back(i);
+inline vector<uint8_t> MTF_decode(const vector<uint8_t>& input) {
+    uint8_t order[256];
+    for (int i = 0; i < 256; i++) {
+        order[i] = (uint8_t)i;
     }
 
-    vector<uint8_t> res(input.size());
-    for (size_t i = 0; i < input.size(); i++) {
-        res[i] = dict.at(input[i]);
-        dict.erase(dict.begin() + input[i]);
-        dict.push_front(res[i]);
+    size_t size = input.size();
+    vector<uint8_t> res(size);
+    for (size_t i = 0; i < size; i++) {
+        uint8_t rank = input[i];
+        uint8_t c = order[rank];
+        if (rank == 1) {
+            order[1] = order[0];
+        } else if (rank > 1) {
+            memmove(order + 1, order, rank);
+        }
+        order[0] = c;
+        res[i] = c;
+    }
+    return res;
+}
+
+// Fused MTF and zero-run coding in the style of bzip2. Runs of rank 0 are
+// written in bijective base 2 with the digits RUNA (1) and RUNB (2), least
+// significant first, so a run of n costs about log2(n) symbols. Rank r >= 1
+// becomes symbol r + 1; ranks 254 and 255 do not fit in a byte and are
+// written as MTF_RUN_ESCAPE followed by 0 or 1.
+const uint8_t RUNA = 0;
+const uint8_t RUNB = 1;
+const uint8_t MTF_RUN_ESCAPE = 255;
+
+// res is overwritten, callers can reuse it across blocks
+inline void MTF_RUN_encode(const uint8_t* input, size_t size, vector<uint8_t>& res) {
+    uint8_t order[256];
+    for (int i = 0; i < 256; i++) {
+        order[i] = (uint8_t)i;
+    }
+
+    // A byte yields at most 2 symbols and a run never more symbols than its length
+    res.resize(2 * size);
+    uint8_t* out = res.data();
+    size_t run = 0;
+    auto flush_run = [&]() {
+        while (run > 0) {
+            if (run & 1) {
+                *out++ = RUNA;
+                run = (run - 1) >> 1;
+            } else {
+                *out++ = RUNB;
+                run = (run - 2) >> 1;
+            }
+        }
+    };
+    for (size_t i = 0; i < size; i++) {
+        uint8_t c = input[i];
+        if (order[0] == c) {
+            run++;
+            continue;
+        }
+        flush_run();
+        int rank;
+        if (order[1] == c) {
+            order[1] = order[0];
+            rank = 1;
+        } else {
+            rank = (int)((const uint8_t*)memchr(order + 2, c, 254) - order);
+            memmove(order + 1, order, rank);
+        }
+        order[0] = c;
+        if (rank < MTF_RUN_ESCAPE - 1) {
+            *out++ = (uint8_t)(rank + 1);
+        } else {
+            *out++ = MTF_RUN_ESCAPE;
+            *out++ = (uint8_t)(rank - (MTF_RUN_ESCAPE - 1));
+        }
+    }
+    flush_run();
+    res.resize(out - res.data());
+}
+
+inline vector<uint8_t> MTF_RUN_encode(const vector<uint8_t>& input) {
+    vector<uint8_t> res;
+    MTF_RUN_encode(input.data(), input.size(), res);
+    return res;
+}
+
+// output_size is the size of the block before MTF_RUN_encode, res is
+// overwritten and can be reused across blocks. Returns false when the
+// symbols do not decode to exactly output_size bytes.
+inline bool MTF_RUN_decode(const vector<uint8_t>& input, size_t output_size, vector<uint8_t>& res) {
+    uint8_t order[256];
+    for (int i = 0; i < 256; i++) {
+        order[i] = (uint8_t)i;
+    }
+
+    res.resize(output_size);
+    uint8_t* out = res.data();
+    uint8_t* out_end = out + output_size;
+    size_t run = 0, weight = 1;
+    size_t size = input.size();
+    for (size_t i = 0; i < size; i++) {
+        uint8_t symbol = input[i];
+        if (symbol <= RUNB) {
+            // RUNA adds weight, RUNB twice the weight
+            run += weight << symbol;
+            weight <<= 1;
+            if (run > (size_t)(out_end - out)) {
+                return false;
+            }
+            continue;
+        }
+        if (run > 0) {
+            memset(out, order[0], run);
+            out += run;
+            run = 0;
+            weight = 1;
+        }
+        int rank = symbol - 1;
+        if (symbol == MTF_RUN_ESCAPE) {
+            if (i + 1 == size || input[i + 1] > 1) {
+                return false;
+            }
+            rank = MTF_RUN_ESCAPE - 1 + input[++i];
+        }
+        uint8_t c = order[rank];
+        if (rank == 1) {
+            order[1] = order[0];
+        } else {
+            memmove(order + 1, order, rank);
+        }
+        order[0] = c;
+        if (out == out_end) {
+            return false;
+        }
+        *out++ = c;
     }
+    memset(out, order[0], run);
+    out += run;
+    return out == out_end;
+}
+
+inline vector<uint8_t> MTF_RUN_decode(const vector<uint8_t>& input, size_t output_size) {
+    vector<uint8_t> res;
+    MTF_RUN_decode(input, output_size, res);
     return res;
 }
 
@@ -49,7 +200,7 @@ const int MAX_LENGTH = 255;
 
 // I'm lazy so that I put RLE here
 // This method only encode 0 symbols after the MTF stage
-vector<uint8_t> RLE_encode(const vector<uint8_t>& input) {
+inline vector<uint8_t> RLE_encode(const vector<uint8_t>& input) {
     int zero_count = 0;
     int rle_length = 0;
     vector<uint8_t> encoded;
@@ -80,7 +231,7 @@ vector<uint8_t> RLE_encode(const vector<uint8_t>& input) {
     return encoded;
 }
 
-vector<uint8_t> RLE_decode(const vector<uint8_t>& input) {
+inline vector<uint8_t> RLE_decode(const vector<uint8_t>& input) {
     int zero_count = 0;
     vector<uint8_t> decoded;
     for (size_t i = 0; i < input.size(); i++) {
@@ -103,3 +254,5 @@ vector<uint8_t> RLE_decode(const vector<uint8_t>& input) {
     }
     return decoded;
 }
+
+#endif
@@ -15,30 +15,49 @@
 #define OUTPUT_STREAM_HPP
 
 #include <iostream>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <vector>
 
 /* These definitions are more reliable for fixed width types than using "int" and assuming its width */
 using u8 = std::uint8_t;
 using u16 = std::uint16_t;
 using u32 = std::uint32_t;
+using u64 = std::uint64_t;
 
 
 
+/* Bits are collected LSB first in a 64 bit accumulator and whole bytes are
+   moved to an internal buffer, which goes to the ostream with one write()
+   call whenever it fills up, on flush() and on destruction. Do not write to
+   the ostream directly while an OutputBitStream is attached to it, use
+   push_span instead. A stream can also append to a vector instead of an
+   ostream. */
 class OutputBitStream{
 public:
     /* Constructor */
-    OutputBitStream( std::ostream& output_stream ): bitvec{0}, numbits{0}, outfile{output_stream} {
+    OutputBitStream( std::ostream& output_stream ): bitvec{0}, numbits{0}, buffer_used{0}, outfile{&output_stream}, outvec{nullptr} {
+
+    }
+
+    /* Append to output (which must outlive the stream) */
+    OutputBitStream( std::vector<u8>& output ): bitvec{0}, numbits{0}, buffer_used{0}, outfile{nullptr}, outvec{&output} {
 
     }
 
     /* Destructor (output any leftover bits) */
     virtual ~OutputBitStream(){
-        if (numbits > 0)
-            output_byte();
+        flush_to_byte();
+        flush();
     }
 
     /* Push an entire byte into the stream, with the least significant bit pushed first */
     void push_byte(unsigned char b){
+        if (numbits == 0){
+            put(b);
+            return;
+        }
         push_bits(b,8);
     }
 
@@ -59,44 +78,108 @@ public:
     void push_u32(u32 i){
         push_bits(i,32);
     }
+    /* Push a 64 bit unsigned integer value (LSB first) */
+    void push_u64(u64 i){
+        push_bits((u32)i,32);
+        push_bits((u32)(i>>32),32);
+    }
     /* Push a 16 bit unsigned short value (LSB first) */
     void push_u16(u16 i){
         push_bits(i,16);
     }
+    /* Push a 32 bit unsigned integer in as few bytes as it needs: 7 bits per
+       byte (LSB first), the high bit set when another byte follows */
+    void push_varint(u32 i){
+        while (i >= 0x80){
+            push_byte((unsigned char)(i | 0x80));
+            i >>= 7;
+        }
+        push_byte((unsigned char)i);
+    }
+
+    /* Push size bytes. When the stream is byte aligned they are copied
+       (or written straight through when large), otherwise pushed one at a time. */
+    void push_span(const u8* data, size_t size){
+        if (numbits != 0){
+            for (size_t i = 0; i < size; i++)
+                push_bits(data[i],8);
+            return;
+        }
+        if (size >= BUFFER_SIZE){
+            flush();
+            write(data, size);
+            return;
+        }
+        while (size > 0){
+            if (buffer_used == BUFFER_SIZE)
+                flush();
+            size_t n = std::min(size, BUFFER_SIZE - buffer_used);
+            std::memcpy(buffer + buffer_used, data, n);
+            buffer_used += n;
+            data += n;
+            size -= n;
+        }
+    }
 
     /* Push the lowest order num_bits bits from b into the stream
        with the least significant bit pushed first
     */
     void push_bits(unsigned int b, unsigned int num_bits){
-        for (unsigned int i = 0; i < num_bits; i++)
-            push_bit((b>>i)&1);
+        if (num_bits < 32)
+            b &= (1u<<num_bits) - 1;
+        bitvec |= (u64)b<<numbits;
+        numbits += num_bits;
+        while (numbits >= 8){
+            put((unsigned char)bitvec);
+            bitvec >>= 8;
+            numbits -= 8;
+        }
     }
 
     /* Push a single bit b (stored as the LSB of an unsigned int)
        into the stream */ 
     void push_bit(unsigned int b){
-        bitvec |= (b&1)<<numbits;
-        numbits++;
-        if (numbits == 8)
-            output_byte();
+        push_bits(b&1,1);
     }
 
     /* Flush the currently stored bits to the output stream */
     void flush_to_byte(){
-        if (numbits > 0)
-            output_byte();
+        if (numbits > 0){
+            put((unsigned char)bitvec);
+            bitvec = 0;
+            numbits = 0;
+        }
+    }
+
+    /* Hand the buffered bytes to the ostream (partial bytes stay in the accumulator) */
+    void flush(){
+        if (buffer_used > 0)
+            write(buffer, buffer_used);
+        buffer_used = 0;
     }
 
 
 private:
-    void output_byte(){
-        outfile.put((unsigned char)bitvec);
-        bitvec = 0;
-        numbits = 0;
+    static const size_t BUFFER_SIZE = 1<<16;
+
+    void write(const u8* data, size_t size){
+        if (outvec)
+            outvec->insert(outvec->end(), data, data + size);
+        else
+            outfile->write((const char*)data, size);
+    }
+
+    void put(unsigned char b){
+        if (buffer_used == BUFFER_SIZE)
+            flush();
+        buffer[buffer_used++] = b;
     }
-    u32 bitvec;
+    u64 bitvec;
     u32 numbits;
-    std::ostream& outfile;
+    size_t buffer_used;
+    u8 buffer[BUFFER_SIZE];
+    std::ostream* outfile;
+    std::vector<u8>* outvec;
 };
 
 
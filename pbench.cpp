@@ -0,0 +1,499 @@
+//
+//  pbench.cpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+// Round-trips every file of a corpus through PzipCStream/PzipDStream in
+// memory on one thread and prints one line per file (JSON, or CSV with
+// --csv) with the sizes, end to end and per stage throughput. Times are
+// the best of the repetitions, after the warmup runs. MB is 10^6 bytes.
+// With --record-size, each file is cut into records that are compressed as
+// separate streams by the same stream objects, like small messages, and
+// there is one line per file and record size. --bit-flips N then decodes N
+// copies of the stream of the first record with one bit flipped in each,
+// which must fail with PZIP_STREAM_ERROR or still give the record back, and
+// N prefixes of it, which must not end and may only give back the start of
+// the record.
+// --kernels instead times the MTF and entropy coders on their own, on the
+// BWT output of each block of the files, so they can be compared on real
+// data rather than through the whole pipeline.
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <filesystem>
+#include "pzip.hpp"
+#include "bwt.hpp"
+#include "mtf.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+// Best times of one file over the repetitions, in seconds
+struct BenchResult {
+    string name;
+    // 0 when the whole file is one stream
+    size_t record_size;
+    size_t size;
+    size_t compressed_size;
+    double compress;
+    double decompress;
+    PzipStageTimes encode_stages;
+    PzipStageTimes decode_stages;
+};
+
+const char* FIELDS[] = {
+    "file", "record_size", "size", "compressed", "ratio", "compress_mbps", "decompress_mbps",
+    "bwt_mbps", "mtf_rle_mbps", "entropy_mbps", "entropy_decode_mbps", "mtf_rle_decode_mbps", "inverse_bwt_mbps",
+};
+
+double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void keep_best(PzipStageTimes& best, const PzipStageTimes& times, bool first) {
+    best.bwt = first ? times.bwt : min(best.bwt, times.bwt);
+    best.mtf = first ? times.mtf : min(best.mtf, times.mtf);
+    best.entropy = first ? times.entropy : min(best.entropy, times.entropy);
+}
+
+// Returns false when the data does not survive the round trip
+bool bench_file(const string& name, const u8* data, size_t size, size_t record_size, const CompressOptions& options,
+                int warmup, int repetitions, BenchResult& result) {
+    PzipCStream cstream {options};
+    PzipDStream dstream {options.dictionary};
+    size_t max_record = record_size > 0 ? min(record_size, size) : size;
+    vector<u8> compressed(max_record + max_record / 2 + 4096);
+    vector<u8> decompressed(max_record);
+    result = BenchResult{name, record_size, size, 0, 0, 0, {}, {}};
+
+    for (int run = 0; run < warmup + repetitions; run++) {
+        cstream.stage_times() = PzipStageTimes();
+        dstream.stage_times() = PzipStageTimes();
+        double compress_time = 0, decompress_time = 0;
+        size_t compressed_size = 0;
+        // An empty file is still one (empty) stream
+        size_t offset = 0;
+        do {
+            size_t length = min(max_record, size - offset);
+            cstream.reset();
+            PzipInBuffer in {data + offset, length, 0};
+            PzipOutBuffer out {compressed.data(), compressed.size(), 0};
+            auto start = chrono::steady_clock::now();
+            while (cstream.compress(in, out, PZIP_END) > 0) {
+                compressed.resize(compressed.size() * 2);
+                out.dst = compressed.data();
+                out.size = compressed.size();
+            }
+            compress_time += seconds_since(start);
+            compressed_size += out.pos;
+
+            dstream.reset();
+            PzipInBuffer cin {compressed.data(), out.pos, 0};
+            PzipOutBuffer dout {decompressed.data(), decompressed.size(), 0};
+            start = chrono::steady_clock::now();
+            PzipStreamStatus status = dstream.decompress(cin, dout);
+            decompress_time += seconds_since(start);
+            if (status != PZIP_STREAM_END || dout.pos != length ||
+                !equal(decompressed.begin(), decompressed.begin() + length, data + offset)) {
+                return false;
+            }
+            offset += length;
+        } while (offset < size);
+
+        if (run < warmup) {
+            continue;
+        }
+        bool first = run == warmup;
+        result.compressed_size = compressed_size;
+        result.compress = first ? compress_time : min(result.compress, compress_time);
+        result.decompress = first ? decompress_time : min(result.decompress, decompress_time);
+        keep_best(result.encode_stages, cstream.stage_times(), first);
+        keep_best(result.decode_stages, dstream.stage_times(), first);
+    }
+    return true;
+}
+
+// Returns false when a corrupt copy of the stream is decoded to anything but
+// the original or an error
+bool check_bit_flips(const u8* data, size_t size, size_t record_size, const CompressOptions& options,
+                     int bit_flips) {
+    size_t length = record_size > 0 ? min(record_size, size) : size;
+    PzipCStream cstream {options};
+    vector<u8> compressed(length + length / 2 + 4096);
+    PzipInBuffer in {data, length, 0};
+    PzipOutBuffer out {compressed.data(), compressed.size(), 0};
+    while (cstream.compress(in, out, PZIP_END) > 0) {
+        compressed.resize(compressed.size() * 2);
+        out.dst = compressed.data();
+        out.size = compressed.size();
+    }
+    compressed.resize(out.pos);
+
+    PzipDStream dstream {options.dictionary};
+    vector<u8> decompressed(length);
+    mt19937 rng(1);
+    for (int flip = 0; flip < bit_flips; flip++) {
+        size_t bit = rng() % (compressed.size() * 8);
+        compressed[bit / 8] ^= 1 << (bit % 8);
+        dstream.reset();
+        PzipInBuffer cin {compressed.data(), compressed.size(), 0};
+        PzipOutBuffer dout {decompressed.data(), decompressed.size(), 0};
+        PzipStreamStatus status = dstream.decompress(cin, dout);
+        compressed[bit / 8] ^= 1 << (bit % 8);
+        // A flip can also land in padding, or make a block look longer than
+        // the input (PZIP_OK while waiting for the rest)
+        if (status == PZIP_STREAM_END &&
+            (dout.pos != length || !equal(decompressed.begin(), decompressed.begin() + length, data))) {
+            return false;
+        }
+    }
+    for (int cut = 0; cut < bit_flips; cut++) {
+        size_t prefix = rng() % compressed.size();
+        dstream.reset();
+        PzipInBuffer cin {compressed.data(), prefix, 0};
+        PzipOutBuffer dout {decompressed.data(), decompressed.size(), 0};
+        PzipStreamStatus status = dstream.decompress(cin, dout);
+        if (status == PZIP_STREAM_END || !equal(decompressed.begin(), decompressed.begin() + dout.pos, data)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --kernels: best time in seconds of each kernel over the blocks of a file,
+// in KERNEL_FIELDS order
+struct KernelResult {
+    string name;
+    size_t size;
+    vector<double> times;
+};
+
+const char* KERNEL_FIELDS[] = {
+    "file", "size", "mtf_mbps", "mtf_decode_mbps", "mtf_rle_mbps", "mtf_rle_decode_mbps",
+    "fse_mbps", "fse_decode_mbps", "huffman_mbps", "huffman_decode_mbps",
+};
+const int NUM_KERNELS = sizeof(KERNEL_FIELDS) / sizeof(KERNEL_FIELDS[0]) - 2;
+
+// Runs the plain MTF, the fused MTF/zero-run coder and both entropy coders
+// (table building included) on the BWT of every block of the file. The BWT
+// itself is not timed. The entropy coders take the fused MTF output, as in
+// the pipeline. Returns false when a kernel does not round-trip.
+bool bench_kernels(const string& name, const u8* data, size_t size, const CompressOptions& options, int warmup,
+                   int repetitions, KernelResult& result) {
+    u32 block_size = options.level.block_size;
+    vector<vector<u8>> blocks;
+    vector<int32_t> suffix_array;
+    vector<int> cursors;
+    for (size_t offset = 0; offset < size; offset += block_size) {
+        int length = (int)min((size_t)block_size, size - offset);
+        int index;
+        blocks.emplace_back();
+        bwt2(data + offset, length, index, cursors, 1, suffix_array, blocks.back());
+    }
+    result = KernelResult{name, size, vector<double>(NUM_KERNELS, 0)};
+
+    FSE fse;
+    Huffman huffman;
+    FSEEncodingTable fse_encoder;
+    FSEDecodingTable fse_decoder;
+    HuffmanDecodingTable huffman_table;
+    vector<u8> ranks, decoded, symbols, encoded, decoded_symbols;
+    vector<int> counts, states;
+    for (int run = 0; run < warmup + repetitions; run++) {
+        vector<double> times(NUM_KERNELS, 0);
+        auto timed = [&](int k, auto kernel) {
+            auto start = chrono::steady_clock::now();
+            kernel();
+            times[k] += seconds_since(start);
+        };
+        for (const vector<u8>& bwt: blocks) {
+            timed(0, [&] { ranks = MTF_encode(bwt); });
+            timed(1, [&] { decoded = MTF_decode(ranks); });
+            if (decoded != bwt) {
+                return false;
+            }
+            timed(2, [&] { MTF_RUN_encode(bwt.data(), bwt.size(), symbols); });
+            bool valid = true;
+            timed(3, [&] { valid = MTF_RUN_decode(symbols, bwt.size(), decoded); });
+            if (!valid || decoded != bwt) {
+                return false;
+            }
+            if (symbols.empty()) {
+                continue;
+            }
+            int num_symbols = *max_element(symbols.begin(), symbols.end()) + 1;
+            counts.assign(num_symbols, 0);
+            for (u8 symbol: symbols) {
+                counts[symbol]++;
+            }
+            decoded_symbols.resize(symbols.size());
+
+            int table_log = 0, byte_offset = 0;
+            vector<int> norm;
+            timed(4, [&] {
+                norm = fse.ChooseTableLog(counts, (int)symbols.size(), options.level.fse, table_log);
+                fse.BuildEncodingTable(norm, num_symbols, table_log, fse_encoder);
+                fse.Encode(symbols, fse_encoder, encoded, byte_offset, states, options.num_states);
+            });
+            timed(5, [&] {
+                fse.BuildDecodingTable(norm, num_symbols, table_log, fse_decoder);
+                fse.Decode(encoded, fse_decoder, decoded_symbols, byte_offset, states);
+            });
+            if (decoded_symbols != symbols) {
+                return false;
+            }
+
+            vector<int> lengths;
+            timed(6, [&] {
+                lengths = huffman.BuildCodeLengths(counts, HUF_MAX_BITS);
+                huffman.Encode(symbols, lengths, encoded);
+            });
+            timed(7, [&] {
+                huffman.BuildDecodingTable(lengths, huffman_table, symbols.size());
+                huffman.Decode(encoded, huffman_table, decoded_symbols);
+            });
+            if (decoded_symbols != symbols) {
+                return false;
+            }
+        }
+        if (run < warmup) {
+            continue;
+        }
+        for (int k = 0; k < NUM_KERNELS; k++) {
+            result.times[k] = run == warmup ? times[k] : min(result.times[k], times[k]);
+        }
+    }
+    return true;
+}
+
+string json_string(const string& s) {
+    string res = "\"";
+    for (char c: s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c;
+    }
+    return res + "\"";
+}
+
+void print_result(const BenchResult& result, bool csv) {
+    auto mbps = [&](double seconds) {
+        return seconds > 0 ? result.size / seconds / 1e6 : 0.0;
+    };
+    double ratio = result.compressed_size > 0 ? (double)result.size / result.compressed_size : 0;
+    vector<double> values = {
+        ratio, mbps(result.compress), mbps(result.decompress),
+        mbps(result.encode_stages.bwt), mbps(result.encode_stages.mtf), mbps(result.encode_stages.entropy),
+        mbps(result.decode_stages.entropy), mbps(result.decode_stages.mtf), mbps(result.decode_stages.bwt),
+    };
+    ostringstream line;
+    line<<fixed<<setprecision(2);
+    if (csv) {
+        line<<result.name<<","<<result.record_size<<","<<result.size<<","<<result.compressed_size;
+        for (double v: values) {
+            line<<","<<v;
+        }
+    } else {
+        line<<"{\"file\": "<<json_string(result.name)<<", \"record_size\": "<<result.record_size
+            <<", \"size\": "<<result.size<<", \"compressed\": "<<result.compressed_size;
+        for (size_t i = 0; i < values.size(); i++) {
+            line<<", \""<<FIELDS[i + 4]<<"\": "<<values[i];
+        }
+        line<<"}";
+    }
+    cout<<line.str()<<endl;
+}
+
+void print_kernels(const KernelResult& result, bool csv) {
+    ostringstream line;
+    line<<fixed<<setprecision(2);
+    if (csv) {
+        line<<result.name<<","<<result.size;
+    } else {
+        line<<"{\"file\": "<<json_string(result.name)<<", \"size\": "<<result.size;
+    }
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        double mbps = result.times[k] > 0 ? result.size / result.times[k] / 1e6 : 0.0;
+        if (csv) {
+            line<<","<<mbps;
+        } else {
+            line<<", \""<<KERNEL_FIELDS[k + 2]<<"\": "<<mbps;
+        }
+    }
+    if (!csv) {
+        line<<"}";
+    }
+    cout<<line.str()<<endl;
+}
+
+int main(int argc, char** argv) {
+    CompressOptions options;
+    u32 block_size = 0;
+    int warmup = 1;
+    int repetitions = 3;
+    bool csv = false;
+    bool kernels = false;
+    int bit_flips = 0;
+    // 0 for whole files
+    vector<size_t> record_sizes;
+    vector<string> paths;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && arg[1] >= '0' + MIN_LEVEL && arg[1] <= '0' + MAX_LEVEL) {
+            options.level = LEVELS[arg[1] - '0'];
+        } else if (arg == "--block-size" && i + 1 < argc) {
+            block_size = parse_size(argv[++i]);
+            if (block_size < PZIP_MIN_BLOCK_SIZE || block_size > PZIP_MAX_BLOCK_SIZE) {
+                cerr<<"Block size must be between "<<PZIP_MIN_BLOCK_SIZE<<" and "<<PZIP_MAX_BLOCK_SIZE<<" bytes"<<endl;
+                return 1;
+            }
+        } else if (arg == "-w" && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else if (arg == "--record-size" && i + 1 < argc) {
+            // Comma separated list
+            stringstream list(argv[++i]);
+            string item;
+            while (getline(list, item, ',')) {
+                record_sizes.push_back(parse_size(item));
+                if (record_sizes.back() == 0) {
+                    cerr<<"Invalid record size "<<item<<endl;
+                    return 1;
+                }
+            }
+        } else if (arg == "--repeat-tables") {
+            options.repeat_tables = true;
+        } else if (arg == "--dict" && i + 1 < argc) {
+            MappedFile file {argv[++i]};
+            PzipDictionary dictionary;
+            if (!file.is_open() || !read_dictionary(file.data(), file.size(), dictionary)) {
+                cerr<<"Cannot read dictionary "<<argv[i]<<endl;
+                return 1;
+            }
+            options.dictionary = make_shared<const PzipDictionary>(move(dictionary));
+        } else if (arg == "--bit-flips" && i + 1 < argc) {
+            bit_flips = atoi(argv[++i]);
+        } else if (arg == "--kernels") {
+            kernels = true;
+        } else if (arg == "--csv") {
+            csv = true;
+        } else if (arg[0] != '-') {
+            paths.push_back(arg);
+        } else {
+            paths.clear();
+            break;
+        }
+    }
+    if (paths.empty() || warmup < 0 || repetitions < 1) {
+        cerr<<"Usage: "<<argv[0]<<" [-1 ... -9] [--block-size N[K|M]] [-w warmup runs] [-r repetitions] [--record-size N[K|M][,...]] [--dict file] [--repeat-tables] [--bit-flips N] [--kernels] [--csv] file or directory..."<<endl;
+        return 1;
+    }
+    if (block_size != 0) {
+        options.level.block_size = block_size;
+    }
+    if (record_sizes.empty()) {
+        record_sizes.push_back(0);
+    }
+
+    // Regular files of the directories, in name order
+    vector<string> files;
+    for (const string& path: paths) {
+        if (!filesystem::is_directory(path)) {
+            files.push_back(path);
+            continue;
+        }
+        vector<string> entries;
+        for (const auto& entry: filesystem::directory_iterator(path)) {
+            if (entry.is_regular_file()) {
+                entries.push_back(entry.path().string());
+            }
+        }
+        sort(entries.begin(), entries.end());
+        files.insert(files.end(), entries.begin(), entries.end());
+    }
+
+    if (kernels) {
+        if (csv) {
+            for (size_t i = 0; i < sizeof(KERNEL_FIELDS) / sizeof(KERNEL_FIELDS[0]); i++) {
+                cout<<(i ? "," : "")<<KERNEL_FIELDS[i];
+            }
+            cout<<endl;
+        }
+        KernelResult total {"TOTAL", 0, vector<double>(NUM_KERNELS, 0)};
+        for (const string& file: files) {
+            MappedFile input {file};
+            if (!input.is_open()) {
+                cerr<<"Cannot open "<<file<<endl;
+                return 1;
+            }
+            KernelResult result;
+            if (!bench_kernels(file, input.data(), input.size(), options, warmup, repetitions, result)) {
+                cerr<<"Kernel round trip failed on "<<file<<endl;
+                return 1;
+            }
+            print_kernels(result, csv);
+            total.size += result.size;
+            for (int k = 0; k < NUM_KERNELS; k++) {
+                total.times[k] += result.times[k];
+            }
+        }
+        print_kernels(total, csv);
+        return 0;
+    }
+
+    if (csv) {
+        for (size_t i = 0; i < sizeof(FIELDS) / sizeof(FIELDS[0]); i++) {
+            cout<<(i ? "," : "")<<FIELDS[i];
+        }
+        cout<<endl;
+    }
+    // One total per record size
+    vector<BenchResult> totals;
+    for (size_t record_size: record_sizes) {
+        totals.push_back(BenchResult{"TOTAL", record_size, 0, 0, 0, 0, {}, {}});
+    }
+    for (const string& file: files) {
+        MappedFile input {file};
+        if (!input.is_open()) {
+            cerr<<"Cannot open "<<file<<endl;
+            return 1;
+        }
+        for (size_t k = 0; k < record_sizes.size(); k++) {
+            BenchResult result;
+            if (!bench_file(file, input.data(), input.size(), record_sizes[k], options, warmup, repetitions, result)) {
+                cerr<<"Round trip failed on "<<file<<endl;
+                return 1;
+            }
+            if (!check_bit_flips(input.data(), input.size(), record_sizes[k], options, bit_flips)) {
+                cerr<<"Corrupt or truncated stream decoded without an error on "<<file<<endl;
+                return 1;
+            }
+            print_result(result, csv);
+
+            BenchResult& total = totals[k];
+            total.size += result.size;
+            total.compressed_size += result.compressed_size;
+            total.compress += result.compress;
+            total.decompress += result.decompress;
+            for (auto stages: {make_pair(&total.encode_stages, &result.encode_stages), make_pair(&total.decode_stages, &result.decode_stages)}) {
+                stages.first->bwt += stages.second->bwt;
+                stages.first->mtf += stages.second->mtf;
+                stages.first->entropy += stages.second->entropy;
+            }
+        }
+    }
+    for (const BenchResult& total: totals) {
+        print_result(total, csv);
+    }
+    return 0;
+}
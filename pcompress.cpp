@@ -8,167 +8,340 @@
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <vector>
 #include <set>
 #include <unordered_map>
-#include <array>
 #include <cassert>
+#include <deque>
+#include <fstream>
+#include "pzip.hpp"
 #include "bwt.hpp"
-#include "mtf.hpp"
-#include "output_stream.hpp"
-#include "CRC.h"
-#include "fse.hpp"
-
-#define CHUNK_SIZE 900000
-#define FSE_MODE 0
-#define RLE_MODE 1
+#include "crc32c.hpp"
+#include "thread_pool.hpp"
+#include "mapped_file.hpp"
 
 using namespace std;
 
-bool check_fse(array<u8, CHUNK_SIZE> block, int block_size) {
-    vector<u8> data(block.begin(), block.begin() + block_size);
+bool check_fse(const u8* block, int block_size) {
+    vector<u8> data(block, block + block_size);
 
     int data_size = block_size;
     int max_val = *max_element(data.begin(), data.end());
     int nSymbols = max_val + 1;
 
-    int byte_offset, state;
+    int table_log = 0, byte_offset = 0;
+    vector<int> states;
     vector<u8> encoded_stream;
     vector<int> freq;
 
     FSE fse;
 
-    bool success = fse.Compress(data, nSymbols, encoded_stream, freq, byte_offset, state);
-    assert(success);
+    fse.Compress(data, nSymbols, encoded_stream, freq, table_log, byte_offset, states, LEVELS[DEFAULT_LEVEL].fse);
 
     vector<u8> decoded_stream(data_size);
-    fse.Decompress(encoded_stream, freq, decoded_stream, byte_offset, state, nSymbols);
+    fse.Decompress(encoded_stream, freq, decoded_stream, table_log, byte_offset, states);
 
     return data == decoded_stream;
 }
 
-bool check_bwt(array<u8, CHUNK_SIZE> block, int block_size) {
+bool check_bwt(const u8* block, int block_size) {
     cerr<<"Checking block with size "<<block_size<<endl;
-    int index;
-    vector<u8> v_block(block.begin(), block.begin() + block_size);
-    vector<u8> encoded = bwt2(v_block, index);
+    int index = 0;
+    vector<int> cursors;
+    vector<u8> encoded = bwt2(block, block_size, index, cursors, 1);
     cerr<<"BWT done, index "<<index<<endl;
     vector<u8> decoded = ibwt(encoded, index);
-    bool res = v_block == decoded;
+    bool res = equal(decoded.begin(), decoded.end(), block);
     if (res) {
         cerr<<"BWT inversion success"<<endl;
     }
     return res;
 }
 
-void compress(OutputBitStream stream, array<u8, CHUNK_SIZE> block, u32 block_size, bool last_block) {
-    int index;
-    vector<u8> v_block(block.begin(), block.begin() + block_size);
-    vector<u8> bwt = bwt2(v_block, index);
-    auto mtf = MTF_encode(bwt);
-    auto rle = RLE_encode(mtf);
-    float ratio = (float)rle.size() / (float)block_size;
-    cerr<<"Original size: "<<block_size<<", rle size: "<<rle.size()<<", ratio: "<<std::setprecision(2)<<ratio<<endl;
-
-//    vector<u8> decoded = ibwt(MTF_decode(RLE_decode(rle)), index);
-//    assert(decoded == v_block);
-//    cerr<<"Decoded successfully"<<endl;
-
-    // ===========================
-    // Do FSE coding
-    int max_val = *max_element(rle.begin(), rle.end());
-    int nSymbols = max_val + 1;
-    int byte_offset, state;
-    vector<u8> encoded_stream;
-    vector<int> freq;
-    FSE fse;
-    bool fse_success = fse.Compress(rle, nSymbols, encoded_stream, freq, byte_offset, state);
-    assert((int)freq.size() == nSymbols);
-
-    // ===========================
-    // Output stream
-    stream.push_byte((u8)last_block);
-    if (fse_success) {
-        // Output FSE bitstream
-        cerr<<"Encoding FSE"<<endl;
-
-        stream.push_byte(FSE_MODE);
-        // Output RLE and BWT meta first.
-        stream.push_u32((u32)index);
-
-        stream.push_u16(nSymbols);
-        stream.push_u32((u32)rle.size());
-        for (int f: freq) {
-            stream.push_u16((u16)f);
+// A coded block, ready to be framed by BlockWriter
+struct EncodedBlock {
+    bool last_block;
+    u8 mode;
+    u32 original_size;
+    // CRC-32C of the original block
+    u32 checksum;
+    vector<u8> payload;
+    BlockStats stats;
+};
+
+// Each worker keeps its context, so the pipeline buffers are allocated once
+// per thread rather than once per block.
+EncodedBlock compress(const u8* block, u32 block_size, bool last_block, const CompressOptions& options) {
+    thread_local PzipCCtx ctx {options};
+    EncodedBlock encoded{last_block, 0, block_size, crc32c(block, block_size), {}, {}};
+    encoded.mode = ctx.compress_block(block, block_size, encoded.payload);
+    encoded.stats = ctx.stats();
+    return encoded;
+}
+
+// One JSON record per block for --stats, offset is the position of the
+// block in the input and times are in milliseconds
+void print_block_stats(ostream& out, size_t index, size_t offset, const BlockStats& stats) {
+    u8 mode = stats.mode & ~MODE_FLAGS;
+    const char* mode_name = mode == STORED_MODE ? "stored" : mode == FSE_TABLES_MODE ? "fse_tables" :
+                            mode == FSE_DICT_MODE ? "fse_dict" :
+                            mode == HUFFMAN_MODE ? "huffman" : mode == RLE_MODE ? "rle" :
+                            mode == FSE_STATES_MODE ? "fse_states" : "fse";
+    double bits_per_symbol = stats.symbols_size > 0 ? 8.0 * stats.coded_size / stats.symbols_size : 0;
+    ostringstream line;
+    line<<fixed<<setprecision(3);
+    line<<"{\"block\": "<<index<<", \"offset\": "<<offset<<", \"size\": "<<stats.original_size
+        <<", \"symbols\": "<<stats.symbols_size<<", \"num_symbols\": "<<stats.num_symbols
+        <<", \"mode\": \""<<mode_name<<"\", \"table_log\": "<<stats.table_log
+        <<", \"fse_size\": "<<stats.fse_size<<", \"huffman_size\": "<<stats.huffman_size
+        <<", \"tables_size\": "<<stats.tables_size<<", \"num_tables\": "<<stats.num_tables
+        <<", \"dict_size\": "<<stats.dict_size<<", \"repeat_size\": "<<stats.repeat_size
+        <<", \"repeat_table\": "<<((stats.mode & REPEAT_TABLE_FLAG) ? "true" : "false")
+        <<", \"coded_size\": "<<stats.coded_size<<", \"payload_size\": "<<stats.payload_size
+        <<", \"entropy_bps\": "<<stats.entropy<<", \"coded_bps\": "<<bits_per_symbol
+        <<", \"bwt_ms\": "<<stats.times.bwt * 1e3<<", \"mtf_rle_ms\": "<<stats.times.mtf * 1e3
+        <<", \"entropy_ms\": "<<stats.times.entropy * 1e3
+        <<", \"suffix_array_bytes\": "<<stats.suffix_array_bytes<<", \"bwt_bytes\": "<<stats.bwt_bytes
+        <<", \"symbols_bytes\": "<<stats.symbols_bytes<<", \"encoded_bytes\": "<<stats.encoded_bytes<<"}";
+    out<<line.str()<<endl;
+}
+
+// Hands blocks to compress() and writes the results in input order.
+// With more than one thread, blocks are compressed on a pool and kept in a
+// reorder queue; at most max_inflight blocks are buffered at any time, the
+// reader blocks on the oldest one when the queue is full.
+class BlockWriter {
+public:
+    BlockWriter(ostream& out, int num_threads, int max_inflight, const CompressOptions& options, bool print_stats,
+                bool write_index):
+        stream{out}, max_inflight{max_inflight}, options{options}, checksum{0}, print_stats{print_stats},
+        write_index{write_index}, num_blocks{0}, offset{0} {
+        if (num_threads > 1) {
+            pool.reset(new ThreadPool(num_threads));
         }
-        stream.push_byte(byte_offset);
-        stream.push_u32(state);
-        stream.push_u32((u32)encoded_stream.size());
-        for (u8 b: encoded_stream) {
-            stream.push_byte(b);
+        compressed_offset = push_stream_header(stream, options.level.block_size, options.dictionary.get());
+    }
+
+    // The caller keeps block valid until finish()
+    void submit(const u8* block, u32 block_size, bool last_block) {
+        if (!pool) {
+            write(compress(block, block_size, last_block, options));
+            return;
         }
-    } else {
-        // fall over RLE bitsream
-        cerr<<"Encoding RLE"<<endl;
-        stream.push_byte(RLE_MODE);
-        stream.push_u32((u32)rle.size());
-        stream.push_u32((u32)index);
-        for (auto byte: rle) {
-            stream.push_byte(byte);
+        if ((int)pending.size() >= max_inflight) {
+            write_oldest();
         }
+        pending.push_back(pool->submit([block, block_size, last_block, this] {
+            return compress(block, block_size, last_block, options);
+        }));
     }
-}
-
-int main(){
 
-    array<u8, CHUNK_SIZE> a{0, 1, 2, 1, 1, 3, 2, 3, 3, 1};
-    assert(check_fse(a, 10));
-
-    OutputBitStream stream {cout};
+    void submit(vector<u8> block, bool last_block) {
+        if (!pool) {
+            write(compress(block.data(), (u32)block.size(), last_block, options));
+            return;
+        }
+        if ((int)pending.size() >= max_inflight) {
+            write_oldest();
+        }
+        pending.push_back(pool->submit([block = move(block), last_block, this] {
+            return compress(block.data(), (u32)block.size(), last_block, options);
+        }));
+    }
 
-    //Pre-cache the CRC table
-    auto crc_table = CRC::CRC_32().MakeTable();
+    void finish() {
+        while (!pending.empty()) {
+            write_oldest();
+        }
+        stream.flush();
+    }
 
-    array< u8, CHUNK_SIZE > block_contents {};
-    u32 block_size {0};
-    u32 bytes_read {0};
+private:
+    void write_oldest() {
+        EncodedBlock block = pending.front().get();
+        pending.pop_front();
+        write(block);
+    }
 
-    char next_byte {};
+    // Block header: last block flag, mode, payload length, original length, checksum
+    void write(const EncodedBlock& block) {
+        push_block_header(stream, block.last_block, block.mode, (u32)block.payload.size(), block.original_size,
+                          block.checksum);
+        stream.push_span(block.payload.data(), block.payload.size());
+        // Block checksums are computed by the workers, the stream checksum is
+        // joined from them in order
+        checksum = crc32c_combine(checksum, block.checksum, block.original_size);
+        u32 compressed_size = PZIP_BLOCK_HEADER_SIZE + (u32)block.payload.size();
+        if (write_index) {
+            index.push_back(PzipIndexEntry{compressed_offset, compressed_size, offset});
+        }
+        compressed_offset += compressed_size;
+        if (block.last_block) {
+            stream.push_u32(checksum);
+            compressed_offset += PZIP_TRAILER_SIZE;
+            if (write_index) {
+                push_index(stream, index, compressed_offset);
+            }
+        }
+        // Records come out in input order, however the blocks were scheduled
+        if (print_stats) {
+            print_block_stats(cerr, num_blocks, offset, block.stats);
+        }
+        num_blocks++;
+        offset += block.original_size;
+    }
 
-    u32 crc {};
+    OutputBitStream stream;
+    int max_inflight;
+    CompressOptions options;
+    unique_ptr<ThreadPool> pool;
+    deque<future<EncodedBlock>> pending;
+    // CRC-32C of the blocks written so far
+    u32 checksum;
+    bool print_stats;
+    bool write_index;
+    vector<PzipIndexEntry> index;
+    size_t num_blocks;
+    // Of the next block in the input and in the output
+    size_t offset;
+    u64 compressed_offset;
+};
 
-    if (!cin.get(next_byte)){
-        //Empty input?
-    }else{
-        bytes_read++;
-        //Update the CRC as we read each byte (there are faster ways to do this)
-        crc = CRC::Calculate(&next_byte, 1, crc_table); //This call creates the initial CRC value from the first byte read.
-        //Read through the input
-        while(1){
-            block_contents.at(block_size++) = next_byte;
+int main(int argc, char** argv){
+    CompressOptions options;
+    // Worker threads and the bound on blocks buffered for the ordered writer
+    int num_threads = 1;
+    int max_inflight = 0;
+    // Overrides the block size of the level when set
+    u32 block_size = 0;
+    bool print_stats = false;
+    bool write_index = false;
+    // Read from stdin and write to stdout unless paths are given
+    string input_path, output_path;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && arg[1] >= '0' + MIN_LEVEL && arg[1] <= '0' + MAX_LEVEL) {
+            options.level = LEVELS[arg[1] - '0'];
+        } else if (arg == "-c" && i + 1 < argc) {
+            options.num_cursors = atoi(argv[++i]);
+        } else if (arg == "-S" && i + 1 < argc) {
+            options.num_states = atoi(argv[++i]);
+        } else if (arg == "-H" && i + 1 < argc) {
+            options.level.huffman_margin = atof(argv[++i]) / 100;
+        } else if (arg == "--block-size" && i + 1 < argc) {
+            block_size = parse_size(argv[++i]);
+            if (block_size < PZIP_MIN_BLOCK_SIZE || block_size > PZIP_MAX_BLOCK_SIZE) {
+                cerr<<"Block size must be between "<<PZIP_MIN_BLOCK_SIZE<<" and "<<PZIP_MAX_BLOCK_SIZE<<" bytes"<<endl;
+                return 1;
+            }
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else if (arg == "--index") {
+            write_index = true;
+        } else if (arg == "--dict" && i + 1 < argc) {
+            // Built once, shared by the contexts of every worker
+            MappedFile file {argv[++i]};
+            PzipDictionary dictionary;
+            if (!file.is_open() || !read_dictionary(file.data(), file.size(), dictionary)) {
+                cerr<<"Cannot read dictionary "<<argv[i]<<endl;
+                return 1;
+            }
+            options.dictionary = make_shared<const PzipDictionary>(move(dictionary));
+        } else if (arg == "--repeat-tables") {
+            options.repeat_tables = true;
+        } else if (arg == "-T" && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (arg == "-M" && i + 1 < argc) {
+            max_inflight = atoi(argv[++i]);
+        } else if (arg[0] != '-' && input_path.empty()) {
+            input_path = arg;
+        } else if (arg[0] != '-' && output_path.empty()) {
+            output_path = arg;
+        } else {
+            cerr<<"Usage: "<<argv[0]<<" [-1 ... -9] [-c cursors] [-S fse states] [-H huffman margin %] [--block-size N[K|M]] [-T threads] [-M max blocks in flight] [--stats] [--index] [--dict file] [--repeat-tables] [input [output]]"<<endl;
+            return 1;
+        }
+    }
+    if (block_size != 0) {
+        options.level.block_size = block_size;
+    }
+    block_size = options.level.block_size;
+    if (options.num_cursors < 1 || options.num_cursors > BWT_MAX_CURSORS) {
+        cerr<<"Number of cursors must be between 1 and "<<BWT_MAX_CURSORS<<endl;
+        return 1;
+    }
+    if (options.num_states != 1 && options.num_states != 2 && options.num_states != 4) {
+        cerr<<"Number of FSE states must be 1, 2 or 4"<<endl;
+        return 1;
+    }
+    if (num_threads < 1) {
+        cerr<<"Number of threads must be at least 1"<<endl;
+        return 1;
+    }
+    // The workers of a pool each see some of the blocks, not the one before
+    if (options.repeat_tables && num_threads > 1) {
+        cerr<<"--repeat-tables compresses blocks in order, it needs -T 1"<<endl;
+        return 1;
+    }
+    if (max_inflight <= 0) {
+        max_inflight = 2 * num_threads;
+    }
 
-            if (!cin.get(next_byte))
-                break;
+    const u8 a[] = {0, 1, 2, 1, 1, 3, 2, 3, 3, 1};
+    assert(check_fse(a, 10));
 
-            bytes_read++;
-            crc = CRC::Calculate(&next_byte,1, crc_table, crc); //Add the character we just read to the CRC (even though it is not in a block yet)
+    ofstream output_file;
+    if (!output_path.empty()) {
+        output_file.open(output_path, ios::binary | ios::trunc);
+        if (!output_file) {
+            cerr<<"Cannot open "<<output_path<<endl;
+            return 1;
+        }
+    }
+    BlockWriter writer {output_path.empty() ? cout : output_file, num_threads, max_inflight, options, print_stats,
+                        write_index};
 
-            //If we get to this point, we just added a byte to the block AND there is at least one more byte in the input waiting to be written.
-            if (block_size == block_contents.size()){
-//                assert(check_fse(block_contents, block_size));
-//                assert(check_bwt(block_contents, block_size));
-                compress(stream, block_contents, block_size, false);
-                block_size = 0;
-            }
+    if (!input_path.empty()) {
+        // Blocks are compressed straight out of the mapping
+        MappedFile input {input_path};
+        if (!input.is_open()) {
+            cerr<<"Cannot open "<<input_path<<endl;
+            return 1;
         }
+        size_t size = input.size();
+        //An empty input still gets one (empty) last block so the decoder knows where to stop
+        size_t offset = 0;
+        do {
+            u32 chunk = (u32)min<size_t>(block_size, size - offset);
+            writer.submit(input.data() + offset, chunk, offset + chunk == size);
+            offset += chunk;
+        } while (offset < size);
+        writer.finish();
+        return 0;
     }
-    //At this point, we've finished reading the input (no new characters remain), and we may have an incomplete block to write.
-    if (block_size > 0){
-//        assert(check_fse(block_contents, block_size));
-//        assert(check_bwt(block_contents, block_size));
-        compress(stream, block_contents, block_size, true);
-        block_size = 0;
+
+    // From stdin: read a block ahead so the last one can be flagged
+    auto read_block = [&]() {
+        vector<u8> block(block_size);
+        cin.read((char*)block.data(), block_size);
+        block.resize(cin.gcount());
+        return block;
+    };
+    vector<u8> block_contents = read_block();
+    while (1) {
+        vector<u8> next = block_contents.size() == block_size ? read_block() : vector<u8>();
+        bool last_block = next.empty();
+//        assert(check_fse(block_contents.data(), block_contents.size()));
+//        assert(check_bwt(block_contents.data(), block_contents.size()));
+        //An empty input still gets one (empty) last block so the decoder knows where to stop
+        writer.submit(move(block_contents), last_block);
+        if (last_block) {
+            break;
+        }
+        block_contents = move(next);
     }
+    writer.finish();
 
     return 0;
 }
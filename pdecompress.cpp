@@ -7,76 +7,457 @@
 //
 
 #include <iostream>
-#include "bwt.hpp"
-#include "mtf.hpp"
-#include "input_stream.hpp"
-#include "fse.hpp"
-#include <cassert>
-
-#define FSE_MODE 0
-#define RLE_MODE 1
+#include <fstream>
+#include <memory>
+#include <deque>
+#include <algorithm>
+#include "pzip.hpp"
+#include "crc32c.hpp"
+#include "thread_pool.hpp"
+#include "mapped_file.hpp"
 
 using namespace std;
 
-int main(){
-
-    InputBitStream stream{cin};
+void write_block(ostream& out, const vector<u8>& decompressed) {
+    out.write((const char*)decompressed.data(), decompressed.size());
+}
 
+// Original format: blocks carry no length, each one has to be parsed to find the next
+void decompress_legacy(InputBitStream& stream, ostream& out) {
+    PzipDCtx ctx;
+    vector<u8> decompressed;
     while (1) {
         u8 last_block = stream.read_byte();
         u8 mode = stream.read_byte();
-        assert(mode == FSE_MODE || mode == RLE_MODE);
-        if (mode == FSE_MODE) {
-            //Read BWT meta
-            u32 index = stream.read_u32();
-
-            u16 num_symbols = stream.read_u16();
-            u32 rle_block_size = stream.read_u32();
-            vector<int> freqs(num_symbols);
-            for (u16 i = 0; i < num_symbols; i++) {
-                freqs[i] = stream.read_u16();
+        if (!ctx.decompress_legacy_block(stream, mode, decompressed)) {
+            cerr<<"Corrupt block"<<endl;
+            exit(1);
+        }
+        write_block(out, decompressed);
+
+        if (last_block == 1) {
+            break;
+        }
+    }
+}
+
+// A framed block whose payload has not been decoded yet. The payload points
+// into the mapped input when there is one, otherwise into storage.
+struct PendingBlock {
+    u8 mode;
+    u32 original_size;
+    const u8* payload;
+    u32 payload_size;
+    // CRC-32C of the original block, version 3 and later
+    u32 checksum;
+    vector<u8> storage;
+    // Last table sent before this block, set when this one reuses it
+    shared_ptr<const PzipBlockTable> previous_table;
+};
+
+// From the stream header: the format version and the largest original
+// length of a block
+u8 stream_version = 1;
+u32 stream_block_size = PZIP_V1_BLOCK_SIZE;
+// Header length, and the dictionary given with --dict
+u32 stream_header_size = PZIP_V1_HEADER_SIZE;
+// The input is a mapped file, which holds every payload in full
+bool mapped_input = false;
+shared_ptr<const PzipDictionary> dictionary;
+
+// Reads one block header and its payload, returns the last block flag
+bool read_block(InputBitStream& stream, PendingBlock& block) {
+    u8 last_block = stream.read_byte();
+    block.mode = stream.read_byte();
+    block.payload_size = stream.read_u32();
+    block.original_size = stream.read_u32();
+    if (block.original_size > stream_block_size) {
+        cerr<<"Corrupt block: "<<block.original_size<<" bytes in a stream of "<<stream_block_size<<" byte blocks"<<endl;
+        exit(1);
+    }
+    if (block.payload_size > max_payload_size(stream_block_size)) {
+        cerr<<"Corrupt block: "<<block.payload_size<<" byte payload in a stream of "<<stream_block_size<<" byte blocks"<<endl;
+        exit(1);
+    }
+    block.checksum = stream_version >= 3 ? stream.read_u32() : 0;
+    block.payload = stream.map_span(block.payload_size);
+    // Padding a cut mapped stream would never reach the last block flag
+    if (!block.payload && mapped_input) {
+        cerr<<"Truncated stream"<<endl;
+        exit(1);
+    }
+    if (!block.payload) {
+        block.storage.resize(block.payload_size);
+        stream.read_span(block.storage.data(), block.payload_size);
+        block.payload = block.storage.data();
+    }
+    return last_block == 1;
+}
+
+// Blocks are read in order: each one that reuses the last table sent
+// (REPEAT_TABLE_FLAG) is given that table, so any worker can decode it.
+// table follows the stream.
+void link_table(PendingBlock& block, shared_ptr<const PzipBlockTable>& table) {
+    if (block.mode & REPEAT_TABLE_FLAG) {
+        if (!table) {
+            cerr<<"Corrupt block: no table to reuse"<<endl;
+            exit(1);
+        }
+        block.previous_table = table;
+    }
+    table = next_block_table(block.mode, block.payload, block.payload_size, table);
+}
+
+// Decodes a block into output, which has room for its original size, and
+// verifies it on the same worker.
+// Each worker keeps its context, so the pipeline buffers are allocated once
+// per thread rather than once per block.
+void decompress_block(const PendingBlock& block, u8* output) {
+    thread_local PzipDCtx ctx {stream_block_size, dictionary};
+    if (!ctx.decompress_block(block.mode, block.payload, block.payload_size, block.original_size, output,
+                              block.previous_table.get())) {
+        cerr<<"Corrupt block: expected "<<block.original_size<<" bytes"<<endl;
+        exit(1);
+    }
+    if (stream_version >= 3 && crc32c(output, block.original_size) != block.checksum) {
+        cerr<<"Corrupt block: checksum mismatch"<<endl;
+        exit(1);
+    }
+}
+
+// Every block matched its own checksum, so the checksums joined in order
+// are the checksum of the output: reordered or missing blocks still show up
+bool check_stream_checksum(InputBitStream& stream, u32 checksum) {
+    if (stream_version < 3 || stream.read_u32() == checksum) {
+        return true;
+    }
+    cerr<<"Corrupt stream: checksum mismatch"<<endl;
+    return false;
+}
+
+vector<u8> decompress_block(const PendingBlock& block) {
+    vector<u8> decompressed(block.original_size);
+    decompress_block(block, decompressed.data());
+    return decompressed;
+}
+
+// Length-prefixed blocks: the reader only copies payloads, decoding happens
+// on the pool and results are written in order, at most max_inflight blocks
+// are buffered at any time.
+bool decompress_blocks(InputBitStream& stream, ostream& out, int num_threads, int max_inflight) {
+    unique_ptr<ThreadPool> pool;
+    if (num_threads > 1) {
+        pool.reset(new ThreadPool(num_threads));
+    }
+    deque<future<vector<u8>>> pending;
+    u32 checksum = 0;
+    shared_ptr<const PzipBlockTable> table;
+    while (1) {
+        PendingBlock block;
+        bool last_block = read_block(stream, block);
+        link_table(block, table);
+        checksum = crc32c_combine(checksum, block.checksum, block.original_size);
+
+        if (!pool) {
+            write_block(out, decompress_block(block));
+        } else {
+            if ((int)pending.size() >= max_inflight) {
+                write_block(out, pending.front().get());
+                pending.pop_front();
             }
-            int byte_offset = stream.read_byte();
-            int state = stream.read_u32();
-            int encoded_size = stream.read_u32();
-            vector<u8> encoded_stream(encoded_size);
-            for (int i = 0; i < encoded_size; i++) {
-                encoded_stream[i] = stream.read_byte();
+            pending.push_back(pool->submit([block = move(block)] {
+                return decompress_block(block);
+            }));
+        }
+
+        if (last_block) {
+            break;
+        }
+    }
+    while (!pending.empty()) {
+        write_block(out, pending.front().get());
+        pending.pop_front();
+    }
+    return check_stream_checksum(stream, checksum);
+}
+
+// Mapped input to an output file: the block headers give every block's
+// offset in the output, which is sized up front and mapped, so each block
+// is decoded in place and blocks can finish in any order.
+bool decompress_blocks_mapped(InputBitStream& stream, const string& output_path, int num_threads, int max_inflight) {
+    vector<PendingBlock> blocks;
+    vector<size_t> offsets;
+    size_t total = 0;
+    u32 checksum = 0;
+    shared_ptr<const PzipBlockTable> table;
+    while (1) {
+        blocks.emplace_back();
+        bool last_block = read_block(stream, blocks.back());
+        link_table(blocks.back(), table);
+        offsets.push_back(total);
+        total += blocks.back().original_size;
+        checksum = crc32c_combine(checksum, blocks.back().checksum, blocks.back().original_size);
+        if (last_block) {
+            break;
+        }
+    }
+    if (!check_stream_checksum(stream, checksum)) {
+        return false;
+    }
+
+    MappedOutputFile output {output_path, total};
+    if (!output.is_open()) {
+        cerr<<"Cannot open "<<output_path<<endl;
+        return false;
+    }
+    if (num_threads == 1) {
+        for (size_t i = 0; i < blocks.size(); i++) {
+            decompress_block(blocks[i], output.data() + offsets[i]);
+        }
+    } else {
+        ThreadPool pool {num_threads};
+        deque<future<void>> pending;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if ((int)pending.size() >= max_inflight) {
+                pending.front().get();
+                pending.pop_front();
             }
-            FSE fse;
-            vector<u8> decoded_stream(rle_block_size);
-            fse.Decompress(encoded_stream, freqs, decoded_stream, byte_offset, state, num_symbols);
+            u8* block_output = output.data() + offsets[i];
+            const PendingBlock* block = &blocks[i];
+            pending.push_back(pool.submit([block, block_output] {
+                decompress_block(*block, block_output);
+            }));
+        }
+        while (!pending.empty()) {
+            pending.front().get();
+            pending.pop_front();
+        }
+    }
+    return true;
+}
 
-            vector<u8> decompressed = ibwt(MTF_decode(RLE_decode(decoded_stream)), index);
-            for (auto b: decompressed) {
-                cout.put(b);
+// Block positions of a stream without an index footer, from its block
+// headers: stream is just past the stream header and no payload is decoded
+bool index_from_headers(InputBitStream& stream, size_t stream_size, vector<PzipIndexEntry>& entries) {
+    u32 block_header_size = stream_version >= 3 ? PZIP_BLOCK_HEADER_SIZE : PZIP_V2_BLOCK_HEADER_SIZE;
+    u64 position = stream_header_size, original_offset = 0;
+    while (1) {
+        PendingBlock block;
+        bool last_block = read_block(stream, block);
+        u32 compressed_size = block_header_size + block.payload_size;
+        if (position + compressed_size > stream_size) {
+            cerr<<"Truncated stream"<<endl;
+            return false;
+        }
+        entries.push_back(PzipIndexEntry{position, compressed_size, original_offset});
+        position += compressed_size;
+        original_offset += block.original_size;
+        if (last_block) {
+            // Without a footer the trailer ends the file, anything else is
+            // a corrupt header that cut the stream short
+            if (position + (stream_version >= 3 ? PZIP_TRAILER_SIZE : 0) != stream_size) {
+                cerr<<"Corrupt stream: data after the last block"<<endl;
+                return false;
             }
+            return true;
+        }
+    }
+}
 
-//            for (auto b: decoded_stream) {
-//                cout.put(b);
-//            }
-        } else {
-            //RLE Mode
-            u32 block_size = stream.read_u32();
-            u32 index = stream.read_u32();
-            vector<u8> block(block_size);
-            for (size_t i = 0; i < block_size; i++) {
-                block[i] = stream.read_byte();
+// --range: decodes only the blocks covering [start, start + length) of the
+// original data, found through the index footer when the stream has one,
+// and writes that slice. Bytes past the end of the data are left out.
+bool decompress_range(const MappedFile& input, InputBitStream& stream, u64 start, u64 length, ostream& out) {
+    vector<PzipIndexEntry> entries;
+    if (!read_index(input.data(), input.size(), entries) && !index_from_headers(stream, input.size(), entries)) {
+        return false;
+    }
+    u32 block_header_size = stream_version >= 3 ? PZIP_BLOCK_HEADER_SIZE : PZIP_V2_BLOCK_HEADER_SIZE;
+    u64 end = start + min(length, UINT64_MAX - start);
+    // Nothing to decode for a range past the end of the data
+    InputBitStream last_stream {input.data() + entries.back().compressed_offset, entries.back().compressed_size};
+    PendingBlock last;
+    read_block(last_stream, last);
+    if (start >= entries.back().original_offset + last.original_size) {
+        return true;
+    }
+    // The last block starting at or before start
+    auto entry = upper_bound(entries.begin(), entries.end(), start, [](u64 offset, const PzipIndexEntry& entry) {
+        return offset < entry.original_offset;
+    }) - 1;
+    // A block reusing a table needs the blocks back to the last one that
+    // sent it: FSE2 or FSE states without REPEAT_TABLE_FLAG
+    auto head = entry;
+    while (head != entries.begin()) {
+        u8 mode = input.data()[head->compressed_offset + 1];
+        if (!(mode & REPEAT_TABLE_FLAG) &&
+            ((mode & ~MODE_FLAGS) == FSE2_MODE || (mode & ~MODE_FLAGS) == FSE_STATES_MODE)) {
+            break;
+        }
+        --head;
+    }
+    shared_ptr<const PzipBlockTable> table;
+    for (; head != entry; ++head) {
+        InputBitStream block_stream {input.data() + head->compressed_offset, head->compressed_size};
+        PendingBlock block;
+        read_block(block_stream, block);
+        table = next_block_table(block.mode, block.payload, block.payload_size, table);
+    }
+    for (; entry != entries.end() && entry->original_offset < end; ++entry) {
+        InputBitStream block_stream {input.data() + entry->compressed_offset, entry->compressed_size};
+        PendingBlock block;
+        read_block(block_stream, block);
+        link_table(block, table);
+        u64 block_end = entry->original_offset + block.original_size;
+        if (block_header_size + block.payload_size != entry->compressed_size ||
+            (entry + 1 != entries.end() && block_end != (entry + 1)->original_offset)) {
+            cerr<<"Corrupt index"<<endl;
+            return false;
+        }
+        vector<u8> decompressed = decompress_block(block);
+        u64 from = max(start, entry->original_offset) - entry->original_offset;
+        u64 to = min(end, block_end) - entry->original_offset;
+        if (from < to) {
+            out.write((const char*)decompressed.data() + from, to - from);
+        }
+    }
+    return true;
+}
+
+// START:LEN in bytes
+bool parse_range(const string& arg, u64& start, u64& length) {
+    size_t colon = arg.find(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == arg.size() ||
+        arg.find_first_not_of("0123456789:") != string::npos || arg.find(':', colon + 1) != string::npos) {
+        return false;
+    }
+    start = strtoull(arg.c_str(), nullptr, 10);
+    length = strtoull(arg.c_str() + colon + 1, nullptr, 10);
+    return true;
+}
+
+int main(int argc, char** argv){
+    int num_threads = 1;
+    int max_inflight = 0;
+    bool range = false;
+    u64 range_start = 0, range_length = 0;
+    // Read from stdin and write to stdout unless paths are given
+    string input_path, output_path;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-T" && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (arg == "-M" && i + 1 < argc) {
+            max_inflight = atoi(argv[++i]);
+        } else if (arg == "--range" && i + 1 < argc) {
+            range = true;
+            if (!parse_range(argv[++i], range_start, range_length)) {
+                cerr<<"Range must be START:LEN in bytes"<<endl;
+                return 1;
             }
-            vector<u8> decompressed = ibwt(MTF_decode(RLE_decode(block)), index);
-            for (auto b: decompressed) {
-                cout.put(b);
+        } else if (arg == "--dict" && i + 1 < argc) {
+            MappedFile file {argv[++i]};
+            PzipDictionary loaded;
+            if (!file.is_open() || !read_dictionary(file.data(), file.size(), loaded)) {
+                cerr<<"Cannot read dictionary "<<argv[i]<<endl;
+                return 1;
             }
+            dictionary = make_shared<const PzipDictionary>(move(loaded));
+        } else if (arg[0] != '-' && input_path.empty()) {
+            input_path = arg;
+        } else if (arg[0] != '-' && output_path.empty()) {
+            output_path = arg;
+        } else {
+            cerr<<"Usage: "<<argv[0]<<" [-T threads] [-M max blocks in flight] [--range START:LEN] [--dict file] [input [output]]"<<endl;
+            return 1;
+        }
+    }
+    if (num_threads < 1) {
+        cerr<<"Number of threads must be at least 1"<<endl;
+        return 1;
+    }
+    if (max_inflight <= 0) {
+        max_inflight = 2 * num_threads;
+    }
+
+    unique_ptr<MappedFile> input;
+    unique_ptr<InputBitStream> stream;
+    bool empty_input, has_header;
+    if (!input_path.empty()) {
+        input.reset(new MappedFile(input_path));
+        if (!input->is_open()) {
+            cerr<<"Cannot open "<<input_path<<endl;
+            return 1;
         }
+        empty_input = input->size() == 0;
+        has_header = !empty_input && input->data()[0] == PZIP_MAGIC_0;
+        stream.reset(new InputBitStream(input->data(), input->size()));
+        mapped_input = true;
+    } else {
+        empty_input = cin.peek() == EOF;
+        has_header = !empty_input && cin.peek() == PZIP_MAGIC_0;
+        stream.reset(new InputBitStream(cin));
+    }
+    // Seeking needs the whole stream mapped, and block lengths
+    if (range && (!input || !has_header)) {
+        cerr<<"--range needs an input file with a stream header"<<endl;
+        return 1;
+    }
 
-        if (last_block == 1) {
-            break;
+    if (has_header) {
+        if (stream->read_byte() != PZIP_MAGIC_0 || stream->read_byte() != PZIP_MAGIC_1 || stream->read_byte() != PZIP_MAGIC_2) {
+            cerr<<"Not a pzip stream"<<endl;
+            return 1;
+        }
+        u8 version = stream->read_byte();
+        stream_version = version & ~PZIP_DICT_STREAM_FLAG;
+        if (stream_version > PZIP_VERSION || (version & PZIP_DICT_STREAM_FLAG && stream_version < 2)) {
+            cerr<<"Unsupported stream version "<<(int)version<<endl;
+            return 1;
+        }
+        if (stream_version >= 2) {
+            stream_header_size = PZIP_HEADER_SIZE;
+            stream_block_size = stream->read_u32();
+            if (stream_block_size > PZIP_MAX_BLOCK_SIZE) {
+                cerr<<"Unsupported block size "<<stream_block_size<<endl;
+                return 1;
+            }
+        }
+        if (version & PZIP_DICT_STREAM_FLAG) {
+            stream_header_size += PZIP_DICT_ID_SIZE;
+            u32 id = stream->read_u32();
+            if (!dictionary) {
+                cerr<<"The stream needs its dictionary (--dict), ID "<<hex<<id<<endl;
+                return 1;
+            }
+            if (id != dictionary->id) {
+                cerr<<"Wrong dictionary: the stream needs ID "<<hex<<id<<", not "<<dictionary->id<<endl;
+                return 1;
+            }
+        }
+        if (input && !output_path.empty() && !range) {
+            return decompress_blocks_mapped(*stream, output_path, num_threads, max_inflight) ? 0 : 1;
         }
     }
-//    char c;
-//    while(std::cin.get(c)){
-//        std::cout.put(c);
-//    }
 
-    return 0;
+    ofstream output_file;
+    if (!output_path.empty()) {
+        output_file.open(output_path, ios::binary | ios::trunc);
+        if (!output_file) {
+            cerr<<"Cannot open "<<output_path<<endl;
+            return 1;
+        }
+    }
+    ostream& out = output_path.empty() ? cout : output_file;
+    if (empty_input) {
+        return 0;
+    }
+    if (!has_header) {
+        decompress_legacy(*stream, out);
+        return 0;
+    }
+    if (range) {
+        return decompress_range(*input, *stream, range_start, range_length, out) ? 0 : 1;
+    }
+    return decompress_blocks(*stream, out, num_threads, max_inflight) ? 0 : 1;
 }
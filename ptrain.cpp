@@ -0,0 +1,142 @@
+//
+//  ptrain.cpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+// Trains a dictionary of static FSE tables for pcompress/pdecompress --dict.
+// Each sample file is cut into records the size of the messages the
+// dictionary is meant for, every record goes through the BWT and MTF/zero-run
+// stages like a block would, and the symbol counts of the records are
+// clustered into tables (FSE::TrainTables).
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <filesystem>
+#include "pzip.hpp"
+#include "bwt.hpp"
+#include "mtf.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+// Defaults: records of 4 KB, up to 8 tables of 2^11 states, refinement passes
+#define TRAIN_RECORD_SIZE 4096
+#define TRAIN_TABLES 8
+#define TRAIN_TABLE_LOG 11
+#define TRAIN_PASSES 8
+
+int main(int argc, char** argv) {
+    u32 record_size = TRAIN_RECORD_SIZE;
+    int num_tables = TRAIN_TABLES;
+    int table_log = TRAIN_TABLE_LOG;
+    string output_path;
+    vector<string> paths;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--record-size" && i + 1 < argc) {
+            record_size = parse_size(argv[++i]);
+            if (record_size == 0 || record_size > PZIP_MAX_BLOCK_SIZE) {
+                cerr<<"Record size must be between 1 and "<<PZIP_MAX_BLOCK_SIZE<<" bytes"<<endl;
+                return 1;
+            }
+        } else if (arg == "-n" && i + 1 < argc) {
+            num_tables = atoi(argv[++i]);
+            if (num_tables < 1 || num_tables > PZIP_DICT_MAX_TABLES) {
+                cerr<<"Number of tables must be between 1 and "<<PZIP_DICT_MAX_TABLES<<endl;
+                return 1;
+            }
+        } else if (arg == "--table-log" && i + 1 < argc) {
+            table_log = atoi(argv[++i]);
+            if (table_log < FSE_MIN_TABLE_LOG || table_log > FSE_MAX_TABLE_LOG) {
+                cerr<<"Table log must be between "<<FSE_MIN_TABLE_LOG<<" and "<<FSE_MAX_TABLE_LOG<<endl;
+                return 1;
+            }
+        } else if (arg == "-o" && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (arg[0] != '-') {
+            paths.push_back(arg);
+        } else {
+            paths.clear();
+            break;
+        }
+    }
+    if (paths.empty() || output_path.empty()) {
+        cerr<<"Usage: "<<argv[0]<<" [--record-size N[K|M]] [-n tables] [--table-log L] -o dictionary files or directories..."<<endl;
+        return 1;
+    }
+
+    // Regular files of the directories, in name order
+    vector<string> files;
+    for (const string& path: paths) {
+        if (!filesystem::is_directory(path)) {
+            files.push_back(path);
+            continue;
+        }
+        vector<string> entries;
+        for (const auto& entry: filesystem::directory_iterator(path)) {
+            if (entry.is_regular_file()) {
+                entries.push_back(entry.path().string());
+            }
+        }
+        sort(entries.begin(), entries.end());
+        files.insert(files.end(), entries.begin(), entries.end());
+    }
+
+    // Symbol counts of every record
+    vector<vector<int>> samples;
+    vector<int32_t> suffix_array;
+    vector<u8> bwt;
+    vector<u8> symbols;
+    vector<int> cursors;
+    for (const string& file: files) {
+        MappedFile input {file};
+        if (!input.is_open()) {
+            cerr<<"Cannot open "<<file<<endl;
+            return 1;
+        }
+        for (size_t offset = 0; offset < input.size(); offset += record_size) {
+            int length = (int)min<size_t>(record_size, input.size() - offset);
+            int index = 0;
+            bwt2(input.data() + offset, length, index, cursors, 1, suffix_array, bwt);
+            MTF_RUN_encode(bwt.data(), bwt.size(), symbols);
+            vector<int> counts(256, 0);
+            for (u8 symbol: symbols) {
+                counts[symbol]++;
+            }
+            samples.push_back(move(counts));
+        }
+    }
+    if (samples.empty()) {
+        cerr<<"No samples to train on"<<endl;
+        return 1;
+    }
+
+    FSE fse;
+    PzipDictionary dictionary;
+    for (vector<int>& norm: fse.TrainTables(samples, num_tables, table_log, TRAIN_PASSES)) {
+        dictionary.tables.push_back(PzipDictTable{move(norm), table_log, {}, {}, {}});
+    }
+    if (dictionary.tables.empty()) {
+        cerr<<"No samples to train on"<<endl;
+        return 1;
+    }
+    build_dictionary(dictionary);
+
+    ofstream output {output_path, ios::binary | ios::trunc};
+    if (!output) {
+        cerr<<"Cannot open "<<output_path<<endl;
+        return 1;
+    }
+    {
+        OutputBitStream stream {output};
+        push_dictionary(stream, dictionary);
+    }
+    cerr<<samples.size()<<" records, "<<dictionary.tables.size()<<" tables of 2^"<<table_log<<" states, ID "
+        <<hex<<dictionary.id<<endl;
+    return 0;
+}
@@ -0,0 +1,1333 @@
+//
+//  pzip.cpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include "pzip.hpp"
+#include "crc32c.hpp"
+#include "bwt.hpp"
+#include "mtf.hpp"
+
+using namespace std;
+
+PzipCCtx::PzipCCtx(const CompressOptions& options): options{options}, last_stats{}, repeat_log{0} {
+    u32 max_block_size = options.level.block_size;
+    suffix_array.reserve(max_block_size + 2);
+    bwt.reserve(max_block_size);
+    // MTF_RUN_encode writes up to 2 symbols per byte
+    symbols.reserve(2 * (size_t)max_block_size);
+    encoded.reserve((size_t)max_block_size * FSE_MAX_TABLE_LOG / 8 + 16);
+}
+
+void PzipCCtx::reset() {
+    repeat_norm.clear();
+}
+
+// Seconds since mark, which moves to now
+static double lap(chrono::steady_clock::time_point& mark) {
+    auto now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(now - mark).count();
+    mark = now;
+    return elapsed;
+}
+
+// Compressed or encrypted input is stored rather than sent through the BWT.
+// The order-0 entropy is estimated on windows spread over the block, then
+// content-defined anchors (4-byte strings whose hash has its top bits clear)
+// are looked up in a table of the previous ones: the block is incompressible
+// when its sample is close to 8 bits per byte and almost no anchor repeats.
+// Low order structure and copies at any distance both show up as repeats.
+#define STORED_SAMPLE_WINDOWS 16
+#define STORED_SAMPLE_WINDOW 4096
+#define STORED_MIN_ENTROPY 7.95
+#define STORED_ANCHOR_BITS 4
+#define STORED_TABLE_LOG 16
+#define STORED_MAX_REPEATS (1.0 / 32)
+
+bool PzipCCtx::incompressible(const u8* block, u32 block_size, double& entropy) {
+    u32 windows = STORED_SAMPLE_WINDOWS;
+    u32 window = STORED_SAMPLE_WINDOW;
+    if ((size_t)windows * window >= block_size) {
+        windows = 1;
+        window = block_size;
+    }
+    u32 stride = windows > 1 ? block_size / windows : 0;
+    int histogram[256] = {0};
+    for (u32 w = 0; w < windows; w++) {
+        const u8* sample = block + (size_t)w * stride;
+        for (u32 i = 0; i < window; i++) {
+            histogram[sample[i]]++;
+        }
+    }
+    u32 sampled = windows * window;
+    entropy = 0;
+    for (int count: histogram) {
+        if (count > 0) {
+            double p = (double)count / sampled;
+            entropy -= p * log2(p);
+        }
+    }
+    if (entropy < STORED_MIN_ENTROPY) {
+        return false;
+    }
+
+    // Positions + 1, 0 is empty
+    anchor_table.assign((size_t)1 << STORED_TABLE_LOG, 0);
+    u32 num_anchors = 0, repeats = 0;
+    for (u32 i = 0; i + 4 <= block_size; i++) {
+        u32 word;
+        memcpy(&word, block + i, 4);
+        uint64_t hash = word * 0x9E3779B185EBCA87ull;
+        if (hash >> (64 - STORED_ANCHOR_BITS)) {
+            continue;
+        }
+        num_anchors++;
+        u32& slot = anchor_table[(hash >> 32) & ((1 << STORED_TABLE_LOG) - 1)];
+        if (slot != 0 && memcmp(block + slot - 1, block + i, 4) == 0) {
+            repeats++;
+        }
+        slot = i + 1;
+    }
+    return num_anchors > 0 && repeats < num_anchors * STORED_MAX_REPEATS;
+}
+
+// Blocks are written with compact headers (COMPACT_HEADER_FLAG): integer
+// fields are varints and the FSE counts and Huffman code lengths are
+// bit-packed, which matters for blocks of a few KB.
+static size_t varint_size(u32 value) {
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7) {
+        size++;
+    }
+    return size;
+}
+
+// Writes the BWT index and extra start rows, returns their size
+static size_t push_bwt_meta(OutputBitStream* stream, int index, const vector<int>& cursors) {
+    size_t size = varint_size((u32)index);
+    if (stream) {
+        stream->push_varint((u32)index);
+    }
+    if (!cursors.empty()) {
+        size += 1;
+        if (stream) {
+            stream->push_byte((u8)cursors.size());
+        }
+        for (int row: cursors) {
+            size += varint_size((u32)row);
+            if (stream) {
+                stream->push_varint((u32)row);
+            }
+        }
+    }
+    return size;
+}
+
+static void push_exp_golomb(OutputBitStream& stream, u32 value, int k) {
+    u32 v = value + (1u << k);
+    int len = 0;
+    for (u32 x = v; x; x >>= 1) {
+        len++;
+    }
+    stream.push_bits(0, len - 1 - k);
+    stream.push_bit(1);
+    stream.push_bits(v, len - 1);
+}
+
+// UINT32_MAX when the code does not fit 32 bits, which only a corrupt
+// header has
+static u32 read_exp_golomb(InputBitStream& stream, int k) {
+    int zeros = 0;
+    while (!stream.read_bit()) {
+        if (++zeros + k >= 32) {
+            return UINT32_MAX;
+        }
+    }
+    int low_bits = zeros + k;
+    u32 v = 1u << low_bits;
+    if (low_bits > 0) {
+        v |= stream.read_bits(low_bits);
+    }
+    return v - (1u << k);
+}
+
+// Normalized counts of a compact header: table log and Exp-Golomb order
+// (4 bits each), then the counts up to the one that completes the table
+// (see FSE::CountsHeaderBits). Returns the size in bits.
+static int push_counts(OutputBitStream* stream, FSE& fse, const vector<int>& norm, int table_log) {
+    int k;
+    int bits = 8 + fse.CountsHeaderBits(norm, table_log, k);
+    if (stream) {
+        stream->push_bits(table_log, 4);
+        stream->push_bits(k, 4);
+        int sum = 0;
+        for (size_t s = 0; s < norm.size() && sum < (1 << table_log); s++) {
+            push_exp_golomb(*stream, norm[s], k);
+            sum += norm[s];
+        }
+    }
+    return bits;
+}
+
+// Returns the table log, 0 when the counts do not add up to the table size
+static int read_counts(InputBitStream& stream, int num_symbols, vector<int>& norm) {
+    int table_log = stream.read_bits(4);
+    int k = stream.read_bits(4);
+    if (table_log < 1 || table_log > FSE_MAX_TABLE_LOG) {
+        return 0;
+    }
+    norm.assign(num_symbols, 0);
+    u32 remaining = 1u << table_log;
+    for (int s = 0; s < num_symbols && remaining > 0; s++) {
+        u32 count = read_exp_golomb(stream, k);
+        if (count > remaining) {
+            return 0;
+        }
+        norm[s] = (int)count;
+        remaining -= count;
+    }
+    return remaining == 0 ? table_log : 0;
+}
+
+// Counts of the fixed-size headers, which are read as they are
+static bool valid_counts(const vector<int>& norm, int table_log) {
+    if (table_log < 1 || table_log > FSE_MAX_TABLE_LOG) {
+        return false;
+    }
+    int sum = 0;
+    for (int count: norm) {
+        sum += count;
+    }
+    return sum == 1 << table_log;
+}
+
+// Huffman code lengths of a compact header, in symbol order: 0 for an absent
+// symbol, otherwise 1 and the step from the previous length present
+// (starting at 0) the way bzip2 writes it, 10 per +1 and 11 per -1, then 0.
+// Returns the size in bits.
+static int push_code_lengths(OutputBitStream* stream, const vector<int>& lengths) {
+    int bits = 0, prev = 0;
+    for (int len: lengths) {
+        if (stream) {
+            stream->push_bit(len > 0);
+        }
+        bits++;
+        if (len == 0) {
+            continue;
+        }
+        for (; prev != len; prev += prev < len ? 1 : -1) {
+            if (stream) {
+                stream->push_bits(prev < len ? 1 : 3, 2);
+            }
+            bits += 2;
+        }
+        if (stream) {
+            stream->push_bit(0);
+        }
+        bits++;
+    }
+    return bits;
+}
+
+// Returns false when a length leaves 1 ... HUF_MAX_BITS
+static bool read_code_lengths(InputBitStream& stream, int num_symbols, vector<int>& lengths) {
+    lengths.assign(num_symbols, 0);
+    int prev = 0;
+    for (int& len: lengths) {
+        if (!stream.read_bit()) {
+            continue;
+        }
+        while (stream.read_bit()) {
+            prev += stream.read_bit() ? -1 : 1;
+            if (prev < 0 || prev > HUF_MAX_BITS) {
+                return false;
+            }
+        }
+        if (prev < 1) {
+            return false;
+        }
+        len = prev;
+    }
+    return true;
+}
+
+// FSE tables mode: symbols per table a block needs before it is tried, largest
+// table log (4 decoding tables of 2^11 entries fill 32 KB) and refinement
+// passes over the segments
+#define FSE_TABLES_SYMBOLS_PER_TABLE 2048
+#define FSE_TABLES_MAX_LOG 11
+#define FSE_TABLES_PASSES 4
+
+// Selectors of the FSE tables mode, move-to-front coded (a segment often
+// takes the table of a recent one) and then in unary, LSB first
+static size_t push_selectors(OutputBitStream* stream, const vector<u8>& selectors) {
+    u8 order[FSE_MAX_TABLES];
+    iota(order, order + FSE_MAX_TABLES, 0);
+    size_t bits = 0;
+    for (u8 selector: selectors) {
+        int rank = (int)(find(order, order + FSE_MAX_TABLES, selector) - order);
+        move_backward(order, order + rank, order + rank + 1);
+        order[0] = selector;
+        if (stream) {
+            stream->push_bits((1u << rank) - 1, rank + 1);
+        }
+        bits += rank + 1;
+    }
+    if (stream) {
+        stream->flush_to_byte();
+    }
+    return (bits + 7) / 8;
+}
+
+// Returns false on a rank past the last table: reads past the end of the
+// payload repeat its last bit, so a corrupt one could run on forever
+static bool read_selectors(InputBitStream& stream, int num_tables, vector<u8>& selectors) {
+    u8 order[FSE_MAX_TABLES];
+    iota(order, order + FSE_MAX_TABLES, 0);
+    for (u8& selector: selectors) {
+        int rank = 0;
+        while (stream.read_bit()) {
+            if (++rank >= num_tables) {
+                return false;
+            }
+        }
+        selector = order[rank];
+        move_backward(order, order + rank, order + rank + 1);
+        order[0] = selector;
+    }
+    stream.flush_to_byte();
+    return true;
+}
+
+u8 PzipCCtx::compress_block(const u8* block, u32 block_size, vector<u8>& payload) {
+    assert(block_size <= options.level.block_size);
+    payload.clear();
+    OutputBitStream stream {payload};
+
+    auto mark = chrono::steady_clock::now();
+    PzipStageTimes block_times;
+    double byte_entropy = 0;
+    if (incompressible(block, block_size, byte_entropy)) {
+        payload.assign(block, block + block_size);
+        block_times.entropy = lap(mark);
+        times.entropy += block_times.entropy;
+        last_stats = BlockStats{block_size, 0, 0, 0, 0, 0, 0, 0, 0, block_size, block_size, STORED_MODE, 0, byte_entropy, block_times,
+                                0, 0, 0, 0};
+        return STORED_MODE;
+    }
+    block_times.entropy = lap(mark);
+
+    int index = 0;
+    // The LF table of a small block stays in cache, extra chains buy nothing
+    int num_cursors = options.num_cursors;
+    if (block_size < 65536) {
+        num_cursors = 1;
+    }
+    bwt2(block, (int)block_size, index, cursors, num_cursors, suffix_array, bwt);
+    block_times.bwt = lap(mark);
+    u8 flags = (cursors.empty() ? 0 : BWT_CURSORS_FLAG) | MTF_RUN_FLAG | COMPACT_HEADER_FLAG;
+    MTF_RUN_encode(bwt.data(), bwt.size(), symbols);
+    block_times.mtf = lap(mark);
+
+    // ===========================
+    // Do FSE coding
+    // An empty block can only be written as an (empty) RLE stream
+    int max_val = symbols.empty() ? 0 : *max_element(symbols.begin(), symbols.end());
+    int nSymbols = max_val + 1;
+    counts.assign(nSymbols, 0);
+    for (u8 symbol: symbols) {
+        counts[symbol]++;
+    }
+    // BWT meta, alphabet and symbol count, which every entropy mode starts with
+    size_t meta_size = push_bwt_meta(nullptr, index, cursors) + varint_size(nSymbols) + varint_size((u32)symbols.size());
+    int table_log = 0, byte_offset = 0;
+    int num_states = options.num_states;
+    vector<int> freq;
+    size_t fse_size = 0;
+    if (!symbols.empty()) {
+        // Sized from the estimated coded bits, the table is only built and
+        // the symbols coded when FSE is picked
+        freq = fse.ChooseTableLog(counts, (int)symbols.size(), options.level.fse, table_log);
+        u32 coded_bytes = (u32)((fse.CodedBits(counts, freq, table_log) + 7) / 8);
+        int count_bits = push_counts(nullptr, fse, freq, table_log);
+        int state_bits = 3 + (num_states > 1 ? 3 : 0) + num_states * table_log;
+        fse_size = meta_size + (count_bits + state_bits + 7) / 8 + varint_size(coded_bytes) + coded_bytes;
+        // A table the next blocks may reuse needs a state for the rare
+        // symbols of the MTF tail too, which come and go between blocks. It
+        // is sent instead when it costs less than an eighth of the counts a
+        // reuse saves: more pads tables that are never reused.
+        if (options.repeat_tables) {
+            table_counts = counts;
+            int total = (int)symbols.size();
+            for (int& count: table_counts) {
+                total += count == 0;
+                count = max(count, 1);
+            }
+            int padded_log = 0;
+            vector<int> padded = fse.ChooseTableLog(table_counts, total, options.level.fse, padded_log);
+            u32 padded_bytes = (u32)((fse.CodedBits(counts, padded, padded_log) + 7) / 8);
+            int padded_bits = push_counts(nullptr, fse, padded, padded_log) + 3 + (num_states > 1 ? 3 : 0) +
+                              num_states * padded_log;
+            size_t padded_size = meta_size + (padded_bits + 7) / 8 + varint_size(padded_bytes) + padded_bytes;
+            if (padded_size < fse_size + (size_t)count_bits / 64) {
+                freq = move(padded);
+                table_log = padded_log;
+                fse_size = padded_size;
+            }
+        }
+    }
+
+    // ===========================
+    // The last table sent in the stream: no counts to send and no table to
+    // build on either side, as long as it has a state for every symbol
+    size_t repeat_size = 0;
+    if (options.repeat_tables && !repeat_norm.empty() && !symbols.empty() && nSymbols <= (int)repeat_norm.size()) {
+        bool covered = true;
+        for (int s = 0; s < nSymbols && covered; s++) {
+            covered = counts[s] == 0 || repeat_norm[s] > 0;
+        }
+        if (covered) {
+            u32 coded_bytes = (u32)((fse.CodedBits(counts, repeat_norm, repeat_log) + 7) / 8);
+            int header_bits = 3 + (num_states > 1 ? 3 : 0) + num_states * repeat_log;
+            repeat_size = meta_size + (header_bits + 7) / 8 + varint_size(coded_bytes) + coded_bytes;
+        }
+    }
+    // Ties go to the previous table
+    bool repeat = repeat_size > 0 && repeat_size <= fse_size;
+    size_t single_size = repeat ? repeat_size : fse_size;
+
+    // ===========================
+    // Static tables of the dictionary: the block only names its table, which
+    // pays off on small blocks that look like the samples it was trained on.
+    // A table can only code the block if it has a state for every symbol.
+    int dict_table = -1;
+    size_t dict_size = 0;
+    if (options.dictionary && !symbols.empty()) {
+        const vector<PzipDictTable>& tables = options.dictionary->tables;
+        size_t dict_meta_size = push_bwt_meta(nullptr, index, cursors) + 1 + varint_size((u32)symbols.size());
+        for (int t = 0; t < (int)tables.size(); t++) {
+            const vector<int>& norm = tables[t].norm;
+            if (nSymbols > (int)norm.size()) {
+                continue;
+            }
+            bool covered = true;
+            double bits = 0;
+            for (int s = 0; s < nSymbols; s++) {
+                covered &= counts[s] == 0 || norm[s] > 0;
+                bits += counts[s] * tables[t].symbol_bits[s];
+            }
+            if (!covered) {
+                continue;
+            }
+            int log = tables[t].table_log;
+            u32 coded_bytes = (u32)((bits + 7) / 8);
+            size_t size = dict_meta_size + (3 + 3 + num_states * log + 7) / 8 + varint_size(coded_bytes) + coded_bytes;
+            if (dict_table < 0 || size < dict_size) {
+                dict_table = t;
+                dict_size = size;
+            }
+        }
+    }
+
+    // ===========================
+    // Several FSE tables, each segment coded with the table that suits it.
+    // Every segment of a table needs a few hundred symbols to pay for its
+    // header, and tables stay small enough for all of them to sit in the
+    // decoder's L1 cache.
+    int num_tables = min(options.level.fse.max_tables, (int)(symbols.size() / FSE_TABLES_SYMBOLS_PER_TABLE));
+    int tables_log = 0, tables_byte_offset = 0;
+    size_t tables_size = 0;
+    if (num_tables > 1) {
+        tables_log = min(table_log, FSE_TABLES_MAX_LOG);
+        fse.ChooseTables(symbols, counts, num_tables, tables_log, FSE_TABLES_PASSES, table_norms, selectors);
+        table_encoders.resize(num_tables);
+        int header_bits = 3 + 3 + num_states * tables_log + 3;
+        for (int t = 0; t < num_tables; t++) {
+            fse.BuildEncodingTable(table_norms[t], nSymbols, tables_log, table_encoders[t]);
+            header_bits += push_counts(nullptr, fse, table_norms[t], tables_log);
+        }
+        fse.EncodeSegments(symbols, table_encoders, selectors, tables_encoded, tables_byte_offset, tables_states,
+                           num_states);
+        tables_size = meta_size + (header_bits + 7) / 8 + push_selectors(nullptr, selectors) +
+                      varint_size((u32)tables_encoded.size()) + tables_encoded.size();
+    }
+    size_t best_fse_size = tables_size > 0 ? min(single_size, tables_size) : single_size;
+    if (dict_size > 0) {
+        best_fse_size = min(best_fse_size, dict_size);
+    }
+
+    // ===========================
+    // Huffman decodes faster, take it unless it costs more than the margin
+    vector<int> code_lengths;
+    size_t huffman_size = 0;
+    if (!symbols.empty()) {
+        code_lengths = huffman.BuildCodeLengths(counts, HUF_MAX_BITS);
+        u32 coded_bytes = (u32)((huffman.CodedBits(counts, code_lengths) + 7) / 8);
+        huffman_size = meta_size + (push_code_lengths(nullptr, code_lengths) + 7) / 8 + varint_size(coded_bytes) +
+                       coded_bytes;
+    }
+    u8 mode = RLE_MODE;
+    if (!symbols.empty() && huffman_size <= best_fse_size * (1 + options.level.huffman_margin) &&
+        huffman_size < symbols.size()) {
+        mode = HUFFMAN_MODE;
+    } else if (dict_size > 0 && dict_size <= best_fse_size && dict_size < symbols.size()) {
+        // Ties go to the dictionary, which builds no table on either side
+        mode = FSE_DICT_MODE;
+    } else if (tables_size > 0 && tables_size < single_size && tables_size < symbols.size()) {
+        mode = FSE_TABLES_MODE;
+    } else if (!symbols.empty() && single_size < symbols.size()) {
+        // Keep the raw RLE stream when FSE does not pay for its header
+        mode = num_states > 1 ? FSE_STATES_MODE : FSE2_MODE;
+    }
+
+    // ===========================
+    // Output stream
+    if (mode == HUFFMAN_MODE) {
+        huffman.Encode(symbols, code_lengths, encoded);
+
+        push_bwt_meta(&stream, index, cursors);
+        stream.push_varint(nSymbols);
+        stream.push_varint((u32)symbols.size());
+        push_code_lengths(&stream, code_lengths);
+        stream.flush_to_byte();
+        stream.push_varint((u32)encoded.size());
+        stream.push_span(encoded.data(), encoded.size());
+    } else if (mode == FSE_TABLES_MODE) {
+        push_bwt_meta(&stream, index, cursors);
+        stream.push_varint(nSymbols);
+        stream.push_varint((u32)symbols.size());
+        stream.push_bits(num_tables - 1, 3);
+        for (const vector<int>& norm: table_norms) {
+            push_counts(&stream, fse, norm, tables_log);
+        }
+        stream.push_bits((u32)tables_states.size(), 3);
+        for (int state: tables_states) {
+            stream.push_bits(state - (1 << tables_log), tables_log);
+        }
+        stream.push_bits(tables_byte_offset, 3);
+        stream.flush_to_byte();
+        push_selectors(&stream, selectors);
+        stream.push_varint((u32)tables_encoded.size());
+        stream.push_span(tables_encoded.data(), tables_encoded.size());
+    } else if (mode == FSE_DICT_MODE) {
+        const PzipDictTable& table = options.dictionary->tables[dict_table];
+        fse.Encode(symbols, table.encoder, encoded, byte_offset, states, num_states);
+
+        push_bwt_meta(&stream, index, cursors);
+        stream.push_byte((u8)dict_table);
+        stream.push_varint((u32)symbols.size());
+        stream.push_bits(byte_offset, 3);
+        stream.push_bits((u32)states.size(), 3);
+        for (int state: states) {
+            stream.push_bits(state - (1 << table.table_log), table.table_log);
+        }
+        stream.flush_to_byte();
+        stream.push_varint((u32)encoded.size());
+        stream.push_span(encoded.data(), encoded.size());
+    } else if (mode != RLE_MODE) {
+        // fse_table still holds the last table sent
+        if (repeat) {
+            flags |= REPEAT_TABLE_FLAG;
+            table_log = repeat_log;
+        } else {
+            fse.BuildEncodingTable(freq, nSymbols, table_log, fse_table);
+        }
+        fse.Encode(symbols, fse_table, encoded, byte_offset, states, num_states);
+
+        // Output RLE and BWT meta first.
+        push_bwt_meta(&stream, index, cursors);
+        stream.push_varint(nSymbols);
+        stream.push_varint((u32)symbols.size());
+        if (!repeat) {
+            push_counts(&stream, fse, freq, table_log);
+        }
+        stream.push_bits(byte_offset, 3);
+        if (states.size() > 1) {
+            stream.push_bits((u32)states.size(), 3);
+        }
+        for (int state: states) {
+            stream.push_bits(state - (1 << table_log), table_log);
+        }
+        stream.flush_to_byte();
+        stream.push_varint((u32)encoded.size());
+        stream.push_span(encoded.data(), encoded.size());
+    } else {
+        // fall over RLE bitsream
+        stream.push_varint((u32)symbols.size());
+        push_bwt_meta(&stream, index, cursors);
+        stream.push_span(symbols.data(), symbols.size());
+    }
+    stream.flush_to_byte();
+    stream.flush();
+
+    bool fse_built = !repeat && (mode == FSE2_MODE || mode == FSE_STATES_MODE);
+    // The estimate missed, or the block is too small to pay for the headers
+    u32 coded_size = (u32)(mode == RLE_MODE ? symbols.size() : mode == FSE_TABLES_MODE ? tables_encoded.size() : encoded.size());
+    // RLE mode sends the symbols as they are and leaves encoded untouched
+    size_t encoded_bytes = mode == RLE_MODE ? 0 : coded_size;
+    if (payload.size() >= block_size) {
+        payload.assign(block, block + block_size);
+        mode = STORED_MODE;
+        flags = 0;
+        coded_size = block_size;
+    }
+    // The table the next blocks may reuse. A block that built fse_table but
+    // went out stored leaves nothing the decoder knows of in it.
+    if (options.repeat_tables && !repeat && (mode == FSE2_MODE || mode == FSE_STATES_MODE)) {
+        repeat_norm = freq;
+        repeat_log = table_log;
+    } else if (options.repeat_tables && mode == STORED_MODE && fse_built) {
+        repeat_norm.clear();
+    }
+
+    block_times.entropy += lap(mark);
+    times.bwt += block_times.bwt;
+    times.mtf += block_times.mtf;
+    times.entropy += block_times.entropy;
+
+    double entropy = 0;
+    for (int count: counts) {
+        if (count > 0) {
+            double p = (double)count / symbols.size();
+            entropy -= p * log2(p);
+        }
+    }
+    bool fse_mode = mode == FSE2_MODE || mode == FSE_STATES_MODE;
+    int chosen_log = fse_mode ? table_log : mode == FSE_TABLES_MODE ? tables_log :
+                     mode == FSE_DICT_MODE ? options.dictionary->tables[dict_table].table_log : 0;
+    last_stats = BlockStats{block_size, (u32)symbols.size(), nSymbols, (u32)fse_size, (u32)huffman_size,
+                            (u32)tables_size, num_tables > 1 ? num_tables : 0, (u32)dict_size, (u32)repeat_size,
+                            (u32)payload.size(),
+                            coded_size, (u8)(mode | flags), chosen_log, entropy, block_times,
+                            suffix_array.size() * sizeof(int32_t), bwt.size(), symbols.size(), encoded_bytes};
+    return mode | flags;
+}
+
+PzipDCtx::PzipDCtx(u32 max_block_size, shared_ptr<const PzipDictionary> dictionary):
+    max_block_size{max_block_size}, index{0}, dictionary{dictionary} {
+    encoded.reserve(max_block_size);
+    symbols.reserve(max_block_size);
+    last_column.reserve(max_block_size);
+    lf.reserve(max_block_size + 1);
+}
+
+// Integer fields are varints in compact headers
+static u32 read_field(InputBitStream& stream, u8 flags) {
+    return flags & COMPACT_HEADER_FLAG ? stream.read_varint() : stream.read_u32();
+}
+
+// Extra inverse BWT start rows, present when BWT_CURSORS_FLAG is set.
+// Returns false when there are more than ibwt walks.
+bool PzipDCtx::read_cursors(InputBitStream& stream, u8 flags) {
+    cursors.clear();
+    if (flags & BWT_CURSORS_FLAG) {
+        int count = stream.read_byte();
+        if (count >= BWT_MAX_CURSORS) {
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            cursors.push_back(read_field(stream, flags));
+        }
+    }
+    return true;
+}
+
+bool PzipDCtx::read_entropy_coded(InputBitStream& stream, u8 mode, u8 flags, int num_symbols, u32 payload_size,
+                                  const PzipBlockTable* previous_table) {
+    bool compact = flags & COMPACT_HEADER_FLAG;
+    // The coded stream ends the payload
+    auto read_encoded = [&]() {
+        u32 encoded_size = compact ? stream.read_varint() : stream.read_u32();
+        if (encoded_size > payload_size) {
+            return false;
+        }
+        encoded.resize(encoded_size);
+        stream.read_span(encoded.data(), encoded_size);
+        return true;
+    };
+    auto valid_states = [&](int table_log) {
+        for (int state: states) {
+            if (state < (1 << table_log) || state >= (2 << table_log)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    if (mode == FSE_TABLES_MODE) {
+        int table_log = 0, num_tables, num_states, byte_offset = 0;
+        if (compact) {
+            num_tables = stream.read_bits(3) + 1;
+            table_decoders.resize(num_tables);
+            for (int t = 0; t < num_tables; t++) {
+                int log = read_counts(stream, num_symbols, freqs);
+                if (log == 0 || (t > 0 && log != table_log)) {
+                    return false;
+                }
+                table_log = log;
+                fse.BuildDecodingTable(freqs, num_symbols, table_log, table_decoders[t]);
+            }
+            num_states = stream.read_bits(3);
+            if (num_states != 1 && num_states != 2 && num_states != 4) {
+                return false;
+            }
+            states.resize(num_states);
+            for (int k = 0; k < num_states; k++) {
+                states[k] = (1 << table_log) + stream.read_bits(table_log);
+            }
+            byte_offset = stream.read_bits(3);
+            stream.flush_to_byte();
+        } else {
+            table_log = stream.read_byte();
+            num_tables = stream.read_byte();
+            if (num_tables < 1 || num_tables > FSE_MAX_TABLES) {
+                return false;
+            }
+            table_decoders.resize(num_tables);
+            freqs.resize(num_symbols);
+            for (int t = 0; t < num_tables; t++) {
+                for (int i = 0; i < num_symbols; i++) {
+                    freqs[i] = stream.read_u16();
+                }
+                if (!valid_counts(freqs, table_log)) {
+                    return false;
+                }
+                fse.BuildDecodingTable(freqs, num_symbols, table_log, table_decoders[t]);
+            }
+            num_states = stream.read_byte();
+            if (num_states != 1 && num_states != 2 && num_states != 4) {
+                return false;
+            }
+            states.resize(num_states);
+            for (int k = 0; k < num_states; k++) {
+                states[k] = stream.read_u16();
+            }
+            if (!valid_states(table_log)) {
+                return false;
+            }
+        }
+        selectors.resize((symbols.size() + FSE_SEGMENT_SIZE - 1) / FSE_SEGMENT_SIZE);
+        if (!read_selectors(stream, num_tables, selectors)) {
+            return false;
+        }
+        if (!compact) {
+            byte_offset = stream.read_byte();
+        }
+        if (!read_encoded()) {
+            return false;
+        }
+        fse.DecodeSegments(encoded, table_decoders, selectors, symbols, byte_offset, states);
+    } else if (mode == FSE2_MODE || mode == FSE_STATES_MODE) {
+        int table_log, byte_offset, num_states;
+        bool build = true;
+        if (flags & REPEAT_TABLE_FLAG) {
+            // The last table sent, which fse_table still holds unless this
+            // context did not decode the block that sent it
+            build = previous_table && (previous_table->norm != table_norm ||
+                                       previous_table->table_log != fse_table.table_log);
+            if (build) {
+                table_norm = previous_table->norm;
+            }
+            table_log = previous_table ? previous_table->table_log : fse_table.table_log;
+            if (num_symbols > (int)table_norm.size()) {
+                return false;
+            }
+            byte_offset = stream.read_bits(3);
+            num_states = mode == FSE_STATES_MODE ? stream.read_bits(3) : 1;
+        } else if (compact) {
+            table_log = read_counts(stream, num_symbols, table_norm);
+            if (table_log == 0) {
+                return false;
+            }
+            byte_offset = stream.read_bits(3);
+            num_states = mode == FSE_STATES_MODE ? stream.read_bits(3) : 1;
+        } else {
+            table_log = stream.read_byte();
+            table_norm.resize(num_symbols);
+            for (int i = 0; i < num_symbols; i++) {
+                table_norm[i] = stream.read_u16();
+            }
+            if (!valid_counts(table_norm, table_log)) {
+                // Nothing a repeat block could reuse
+                table_norm.clear();
+                return false;
+            }
+            byte_offset = stream.read_byte();
+            num_states = mode == FSE_STATES_MODE ? stream.read_byte() : 1;
+        }
+        if (num_states != 1 && num_states != 2 && num_states != 4) {
+            return false;
+        }
+        states.resize(num_states);
+        for (int k = 0; k < num_states; k++) {
+            states[k] = compact ? (1 << table_log) + stream.read_bits(table_log) : stream.read_u16();
+        }
+        stream.flush_to_byte();
+        if (!valid_states(table_log) || !read_encoded()) {
+            return false;
+        }
+        if (build) {
+            fse.BuildDecodingTable(table_norm, (int)table_norm.size(), table_log, fse_table);
+        }
+        fse.Decode(encoded, fse_table, symbols, byte_offset, states);
+    } else if (mode == HUFFMAN_MODE) {
+        if (compact) {
+            if (!read_code_lengths(stream, num_symbols, code_lengths)) {
+                return false;
+            }
+            stream.flush_to_byte();
+        } else {
+            code_lengths.resize(num_symbols + 1);
+            for (int s = 0; s < num_symbols; s += 2) {
+                u8 packed = stream.read_byte();
+                code_lengths[s] = packed & 0xF;
+                code_lengths[s + 1] = packed >> 4;
+            }
+            code_lengths.resize(num_symbols);
+        }
+        for (int len: code_lengths) {
+            if (len > HUF_MAX_BITS) {
+                return false;
+            }
+        }
+        if (!read_encoded()) {
+            return false;
+        }
+        huffman.BuildDecodingTable(code_lengths, huffman_table, symbols.size());
+        huffman.Decode(encoded, huffman_table, symbols);
+    } else {
+        // FSE_MODE
+        freqs.resize(num_symbols);
+        for (int i = 0; i < num_symbols; i++) {
+            freqs[i] = stream.read_u16();
+        }
+        int byte_offset = stream.read_byte();
+        int state = stream.read_u32();
+        if (!read_encoded() || !fse.DecompressLegacy(encoded, freqs, symbols, byte_offset, state, num_symbols)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// original_size comes from the block header, streams without one never set
+// MTF_RUN_FLAG and pass the largest size instead. A block of n bytes has at
+// most 2n symbols either way, and nothing in the payload is longer than it.
+bool PzipDCtx::read_payload(InputBitStream& stream, u8 mode, u32 original_size, u32 payload_size,
+                            const PzipBlockTable* previous_table) {
+    auto mark = chrono::steady_clock::now();
+    u8 flags = mode & MODE_FLAGS;
+    mode &= ~MODE_FLAGS;
+    bool compact = flags & COMPACT_HEADER_FLAG;
+    u64 max_symbols = 2 * (u64)original_size;
+    if ((mode != FSE_MODE && mode != RLE_MODE && mode != FSE2_MODE && mode != FSE_STATES_MODE &&
+         mode != HUFFMAN_MODE && mode != FSE_TABLES_MODE && mode != FSE_DICT_MODE) ||
+        (compact && mode == FSE_MODE) || (!compact && mode == FSE_DICT_MODE) ||
+        ((flags & REPEAT_TABLE_FLAG) && (!compact || (mode != FSE2_MODE && mode != FSE_STATES_MODE)))) {
+        return false;
+    }
+    if (mode == RLE_MODE) {
+        u32 block_size = read_field(stream, flags);
+        index = read_field(stream, flags);
+        if (!read_cursors(stream, flags)) {
+            return false;
+        }
+        if (block_size > payload_size || block_size > max_symbols) {
+            return false;
+        }
+        symbols.resize(block_size);
+        stream.read_span(symbols.data(), block_size);
+    } else if (mode == FSE_DICT_MODE) {
+        // BWT meta, table number and symbol count, the table is ready
+        index = read_field(stream, flags);
+        if (!read_cursors(stream, flags)) {
+            return false;
+        }
+        int t = stream.read_byte();
+        u32 num_symbols = stream.read_varint();
+        if (t >= (int)dictionary->tables.size() || num_symbols > max_symbols) {
+            return false;
+        }
+        const PzipDictTable& table = dictionary->tables[t];
+        symbols.resize(num_symbols);
+        int byte_offset = stream.read_bits(3);
+        int num_states = stream.read_bits(3);
+        if (num_states != 1 && num_states != 2 && num_states != 4) {
+            return false;
+        }
+        states.resize(num_states);
+        for (int k = 0; k < num_states; k++) {
+            states[k] = (1 << table.table_log) + stream.read_bits(table.table_log);
+        }
+        stream.flush_to_byte();
+        u32 encoded_size = stream.read_varint();
+        if (encoded_size > payload_size) {
+            return false;
+        }
+        encoded.resize(encoded_size);
+        stream.read_span(encoded.data(), encoded_size);
+        fse.Decode(encoded, table.decoder, symbols, byte_offset, states);
+    } else {
+        // BWT meta, alphabet and symbol count
+        index = read_field(stream, flags);
+        if (!read_cursors(stream, flags)) {
+            return false;
+        }
+        int num_symbols = compact ? stream.read_varint() : stream.read_u16();
+        u32 rle_block_size = read_field(stream, flags);
+        if (num_symbols < 1 || num_symbols > 256 || rle_block_size > max_symbols) {
+            return false;
+        }
+        symbols.resize(rle_block_size);
+        if (!read_entropy_coded(stream, mode, flags, num_symbols, payload_size, previous_table)) {
+            return false;
+        }
+    }
+    times.entropy += lap(mark);
+
+    // Undo the MTF and zero-run stages
+    if (flags & MTF_RUN_FLAG) {
+        if (!MTF_RUN_decode(symbols, original_size, last_column)) {
+            return false;
+        }
+    } else {
+        last_column = MTF_decode(RLE_decode(symbols));
+    }
+    times.mtf += lap(mark);
+    if (last_column.size() > original_size || index > last_column.size()) {
+        return false;
+    }
+    // ibwt starts its walks at these rows of the size + 1 it has
+    for (int row: cursors) {
+        if (row < 0 || (size_t)row > last_column.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PzipDCtx::decompress_block(u8 mode, const u8* payload, u32 payload_size, u32 original_size, u8* output,
+                                const PzipBlockTable* previous_table) {
+    if (mode == STORED_MODE) {
+        if (payload_size != original_size) {
+            return false;
+        }
+        copy(payload, payload + payload_size, output);
+        return true;
+    }
+    if (((mode & ~MODE_FLAGS) == FSE_DICT_MODE && !dictionary) ||
+        (mode & REPEAT_TABLE_FLAG && !previous_table && table_norm.empty())) {
+        return false;
+    }
+    InputBitStream stream {payload, payload_size};
+    if (!read_payload(stream, mode, original_size, payload_size, previous_table) ||
+        last_column.size() != original_size) {
+        // The counts may not match fse_table any more
+        table_norm.clear();
+        return false;
+    }
+    auto mark = chrono::steady_clock::now();
+    ibwt(last_column, index, cursors, output, lf);
+    times.bwt += lap(mark);
+    return true;
+}
+
+bool PzipDCtx::decompress_legacy_block(InputBitStream& stream, u8 mode, vector<u8>& output) {
+    // No payload length either: a coded stream is bounded by the symbols of
+    // the largest block at the widest FSE code
+    if (!read_payload(stream, mode, max_block_size, 4 * max_block_size, nullptr)) {
+        return false;
+    }
+    output.resize(last_column.size());
+    auto mark = chrono::steady_clock::now();
+    ibwt(last_column, index, cursors, output.data(), lf);
+    times.bwt += lap(mark);
+    return true;
+}
+
+shared_ptr<const PzipBlockTable> next_block_table(u8 mode, const u8* payload, u32 payload_size,
+                                                  const shared_ptr<const PzipBlockTable>& previous) {
+    u8 flags = mode & MODE_FLAGS;
+    mode &= ~MODE_FLAGS;
+    // Only FSE2 and FSE states blocks sending their counts change the table,
+    // and repeat blocks only follow compact ones
+    if ((mode != FSE2_MODE && mode != FSE_STATES_MODE) || !(flags & COMPACT_HEADER_FLAG) ||
+        (flags & REPEAT_TABLE_FLAG)) {
+        return previous;
+    }
+    // BWT meta, alphabet, symbol count, then the counts
+    InputBitStream stream {payload, payload_size};
+    stream.read_varint();
+    if (flags & BWT_CURSORS_FLAG) {
+        for (int count = stream.read_byte(); count > 0; count--) {
+            stream.read_varint();
+        }
+    }
+    u32 num_symbols = stream.read_varint();
+    stream.read_varint();
+    if (num_symbols < 1 || num_symbols > 256) {
+        return nullptr;
+    }
+    auto table = make_shared<PzipBlockTable>();
+    table->table_log = read_counts(stream, (int)num_symbols, table->norm);
+    // Corrupt counts leave nothing to reuse, the block fails to decode
+    return table->table_log > 0 ? table : nullptr;
+}
+
+u32 parse_size(const string& arg) {
+    char* end;
+    unsigned long long size = strtoull(arg.c_str(), &end, 10);
+    string suffix = end;
+    if (end == arg.c_str() || arg[0] == '-') {
+        return 0;
+    }
+    if (suffix == "K" || suffix == "k") {
+        size <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        size <<= 20;
+    } else if (!suffix.empty()) {
+        return 0;
+    }
+    return size > UINT32_MAX ? 0 : (u32)size;
+}
+
+u32 push_stream_header(OutputBitStream& stream, u32 block_size, const PzipDictionary* dictionary) {
+    stream.push_bytes(PZIP_MAGIC_0, PZIP_MAGIC_1, PZIP_MAGIC_2, PZIP_VERSION | (dictionary ? PZIP_DICT_STREAM_FLAG : 0));
+    stream.push_u32(block_size);
+    if (!dictionary) {
+        return PZIP_HEADER_SIZE;
+    }
+    stream.push_u32(dictionary->id);
+    return PZIP_HEADER_SIZE + PZIP_DICT_ID_SIZE;
+}
+
+void push_block_header(OutputBitStream& stream, bool last_block, u8 mode, u32 payload_size, u32 original_size,
+                       u32 checksum) {
+    stream.push_byte((u8)last_block);
+    stream.push_byte(mode);
+    stream.push_u32(payload_size);
+    stream.push_u32(original_size);
+    stream.push_u32(checksum);
+}
+
+void push_index(OutputBitStream& stream, const vector<PzipIndexEntry>& entries, u64 index_offset) {
+    vector<u8> bytes;
+    {
+        OutputBitStream entry_stream {bytes};
+        for (const PzipIndexEntry& entry: entries) {
+            entry_stream.push_u64(entry.compressed_offset);
+            entry_stream.push_u32(entry.compressed_size);
+            entry_stream.push_u64(entry.original_offset);
+        }
+    }
+    stream.push_span(bytes.data(), bytes.size());
+    stream.push_u32((u32)entries.size());
+    stream.push_u64(index_offset);
+    stream.push_u32(crc32c(bytes.data(), bytes.size()));
+    stream.push_bytes(PZIP_INDEX_MAGIC_0, PZIP_INDEX_MAGIC_1, PZIP_INDEX_MAGIC_2, PZIP_INDEX_VERSION);
+}
+
+bool read_index(const u8* data, size_t size, vector<PzipIndexEntry>& entries) {
+    entries.clear();
+    if (size < PZIP_HEADER_SIZE + PZIP_INDEX_TRAILER_SIZE) {
+        return false;
+    }
+    InputBitStream trailer {data + size - PZIP_INDEX_TRAILER_SIZE, PZIP_INDEX_TRAILER_SIZE};
+    u32 num_blocks = trailer.read_u32();
+    u64 index_offset = trailer.read_u64();
+    u32 checksum = trailer.read_u32();
+    if (trailer.read_byte() != PZIP_INDEX_MAGIC_0 || trailer.read_byte() != PZIP_INDEX_MAGIC_1 ||
+        trailer.read_byte() != PZIP_INDEX_MAGIC_2 || trailer.read_byte() != PZIP_INDEX_VERSION) {
+        return false;
+    }
+    // The entries fill the space between index_offset and the trailer
+    u64 header_size = PZIP_HEADER_SIZE + (data[3] & PZIP_DICT_STREAM_FLAG ? PZIP_DICT_ID_SIZE : 0);
+    u64 index_size = (u64)num_blocks * PZIP_INDEX_ENTRY_SIZE;
+    if (num_blocks == 0 || index_offset < header_size || index_offset > size ||
+        index_size + PZIP_INDEX_TRAILER_SIZE != size - index_offset ||
+        crc32c(data + index_offset, index_size) != checksum) {
+        return false;
+    }
+    // Blocks follow each other from the stream header to the stream trailer
+    InputBitStream stream {data + index_offset, index_size};
+    u64 next_offset = header_size;
+    for (u32 i = 0; i < num_blocks; i++) {
+        PzipIndexEntry entry;
+        entry.compressed_offset = stream.read_u64();
+        entry.compressed_size = stream.read_u32();
+        entry.original_offset = stream.read_u64();
+        if (entry.compressed_offset != next_offset || entry.compressed_size < PZIP_BLOCK_HEADER_SIZE ||
+            (i == 0 ? entry.original_offset != 0 : entry.original_offset < entries.back().original_offset)) {
+            entries.clear();
+            return false;
+        }
+        next_offset += entry.compressed_size;
+        entries.push_back(entry);
+    }
+    if (next_offset + PZIP_TRAILER_SIZE != index_offset) {
+        entries.clear();
+        return false;
+    }
+    return true;
+}
+
+// Tables of a dictionary file, the bytes its ID is the checksum of
+static void push_dict_tables(OutputBitStream& stream, const PzipDictionary& dictionary) {
+    FSE fse;
+    stream.push_byte((u8)dictionary.tables.size());
+    for (const PzipDictTable& table: dictionary.tables) {
+        stream.push_varint((u32)table.norm.size());
+        push_counts(&stream, fse, table.norm, table.table_log);
+        stream.flush_to_byte();
+    }
+}
+
+void build_dictionary(PzipDictionary& dictionary) {
+    assert(!dictionary.tables.empty() && dictionary.tables.size() <= PZIP_DICT_MAX_TABLES);
+    vector<u8> bytes;
+    {
+        OutputBitStream stream {bytes};
+        push_dict_tables(stream, dictionary);
+    }
+    dictionary.id = crc32c(bytes.data(), bytes.size());
+    FSE fse;
+    for (PzipDictTable& table: dictionary.tables) {
+        int num_symbols = (int)table.norm.size();
+        fse.BuildEncodingTable(table.norm, num_symbols, table.table_log, table.encoder);
+        fse.BuildDecodingTable(table.norm, num_symbols, table.table_log, table.decoder);
+        table.symbol_bits.assign(num_symbols, 0);
+        for (int s = 0; s < num_symbols; s++) {
+            if (table.norm[s] > 0) {
+                table.symbol_bits[s] = table.table_log - log2(table.norm[s]);
+            }
+        }
+    }
+}
+
+void push_dictionary(OutputBitStream& stream, const PzipDictionary& dictionary) {
+    stream.push_bytes(PZIP_DICT_MAGIC_0, PZIP_DICT_MAGIC_1, PZIP_DICT_MAGIC_2, PZIP_DICT_VERSION);
+    stream.push_u32(dictionary.id);
+    push_dict_tables(stream, dictionary);
+}
+
+bool read_dictionary(const u8* data, size_t size, PzipDictionary& dictionary) {
+    const size_t header_size = 8;
+    if (size <= header_size || data[0] != PZIP_DICT_MAGIC_0 || data[1] != PZIP_DICT_MAGIC_1 ||
+        data[2] != PZIP_DICT_MAGIC_2 || data[3] != PZIP_DICT_VERSION) {
+        return false;
+    }
+    InputBitStream header {data + 4, 4};
+    u32 id = header.read_u32();
+    // The counts are only parsed once they are known to be intact
+    if (crc32c(data + header_size, size - header_size) != id) {
+        return false;
+    }
+    InputBitStream stream {data + header_size, size - header_size};
+    int num_tables = stream.read_byte();
+    if (num_tables == 0 || num_tables > PZIP_DICT_MAX_TABLES) {
+        return false;
+    }
+    dictionary.tables.assign(num_tables, PzipDictTable());
+    for (PzipDictTable& table: dictionary.tables) {
+        u32 num_symbols = stream.read_varint();
+        if (num_symbols == 0 || num_symbols > 256) {
+            return false;
+        }
+        table.table_log = read_counts(stream, (int)num_symbols, table.norm);
+        if (table.table_log == 0) {
+            return false;
+        }
+        stream.flush_to_byte();
+    }
+    build_dictionary(dictionary);
+    return true;
+}
+
+PzipCStream::PzipCStream(const CompressOptions& options): ctx{options} {
+    input.reserve(options.level.block_size);
+    reset();
+}
+
+void PzipCStream::reset() {
+    input.clear();
+    pending.clear();
+    pending_pos = 0;
+    checksum = 0;
+    finished = false;
+    ctx.reset();
+    OutputBitStream stream {pending};
+    push_stream_header(stream, ctx.compress_options().level.block_size, ctx.compress_options().dictionary.get());
+}
+
+void PzipCStream::compress_input(bool last_block) {
+    u8 mode = ctx.compress_block(input.data(), (u32)input.size(), payload);
+    u32 block_checksum = crc32c(input.data(), input.size());
+    checksum = crc32c_combine(checksum, block_checksum, input.size());
+    {
+        OutputBitStream stream {pending};
+        push_block_header(stream, last_block, mode, (u32)payload.size(), (u32)input.size(), block_checksum);
+        stream.push_span(payload.data(), payload.size());
+        if (last_block) {
+            stream.push_u32(checksum);
+        }
+    }
+    input.clear();
+}
+
+void PzipCStream::drain(PzipOutBuffer& out) {
+    size_t n = min(pending.size() - pending_pos, out.size - out.pos);
+    memcpy(out.dst + out.pos, pending.data() + pending_pos, n);
+    out.pos += n;
+    pending_pos += n;
+    if (pending_pos == pending.size()) {
+        pending.clear();
+        pending_pos = 0;
+    }
+}
+
+size_t PzipCStream::compress(PzipInBuffer& in, PzipOutBuffer& out, PzipFlushMode mode) {
+    while (1) {
+        drain(out);
+        // At most one block waits for the caller, input is taken once it is out
+        if (!pending.empty() || finished) {
+            return pending.size() - pending_pos;
+        }
+        size_t take = min(in.size - in.pos, (size_t)ctx.compress_options().level.block_size - input.size());
+        input.insert(input.end(), in.src + in.pos, in.src + in.pos + take);
+        in.pos += take;
+        if (in.pos < in.size) {
+            // The buffered block is full and more input follows
+            compress_input(false);
+        } else if (mode == PZIP_END) {
+            //An empty stream still gets one (empty) last block so the decoder knows where to stop
+            compress_input(true);
+            finished = true;
+        } else if (mode == PZIP_FLUSH && !input.empty()) {
+            compress_input(false);
+        } else {
+            return 0;
+        }
+    }
+}
+
+PzipDStream::PzipDStream(shared_ptr<const PzipDictionary> dictionary):
+    ctx{PZIP_V1_BLOCK_SIZE, dictionary}, dictionary{dictionary} {
+    reset();
+}
+
+void PzipDStream::reset() {
+    stage = STREAM_HEADER;
+    input.clear();
+    output.clear();
+    output_pos = 0;
+    checksum = 0;
+    finished = false;
+    failed = false;
+}
+
+PzipStreamStatus PzipDStream::decompress(PzipInBuffer& in, PzipOutBuffer& out) {
+    if (failed) {
+        return PZIP_STREAM_ERROR;
+    }
+    while (1) {
+        size_t n = min(output.size() - output_pos, out.size - out.pos);
+        if (n > 0) {
+            memcpy(out.dst + out.pos, output.data() + output_pos, n);
+        }
+        out.pos += n;
+        output_pos += n;
+        if (output_pos < output.size()) {
+            return PZIP_OK;
+        }
+        if (finished) {
+            return PZIP_STREAM_END;
+        }
+
+        // Gather the header, payload or trailer of the current stage, the
+        // version byte tells how long the headers are
+        size_t needed = payload_size;
+        if (stage == STREAM_HEADER) {
+            needed = PZIP_V1_HEADER_SIZE;
+            if (input.size() >= PZIP_V1_HEADER_SIZE && input[3] >= 2) {
+                needed = PZIP_HEADER_SIZE + (input[3] & PZIP_DICT_STREAM_FLAG ? PZIP_DICT_ID_SIZE : 0);
+            }
+        } else if (stage == BLOCK_HEADER) {
+            needed = version >= 3 ? PZIP_BLOCK_HEADER_SIZE : PZIP_V2_BLOCK_HEADER_SIZE;
+        } else if (stage == TRAILER) {
+            needed = PZIP_TRAILER_SIZE;
+        }
+        size_t take = min(in.size - in.pos, needed - input.size());
+        input.insert(input.end(), in.src + in.pos, in.src + in.pos + take);
+        in.pos += take;
+        if (input.size() < needed) {
+            return PZIP_OK;
+        }
+
+        if (stage == STREAM_HEADER) {
+            version = input[3] & ~PZIP_DICT_STREAM_FLAG;
+            if (input[0] != PZIP_MAGIC_0 || input[1] != PZIP_MAGIC_1 || input[2] != PZIP_MAGIC_2 || version > PZIP_VERSION) {
+                failed = true;
+                return PZIP_STREAM_ERROR;
+            }
+            if (needed == PZIP_V1_HEADER_SIZE && input[3] >= 2) {
+                // Block size (and dictionary ID) still to come
+                continue;
+            }
+            block_size = PZIP_V1_BLOCK_SIZE;
+            // Dictionaries came after the block size field
+            bool dictionary_ok = !(input[3] & PZIP_DICT_STREAM_FLAG) || version >= 2;
+            if (version >= 2) {
+                InputBitStream stream {input.data() + PZIP_V1_HEADER_SIZE, input.size() - PZIP_V1_HEADER_SIZE};
+                block_size = stream.read_u32();
+                if (input[3] & PZIP_DICT_STREAM_FLAG) {
+                    dictionary_ok = dictionary && stream.read_u32() == dictionary->id;
+                }
+            }
+            if (block_size > PZIP_MAX_BLOCK_SIZE || !dictionary_ok) {
+                failed = true;
+                return PZIP_STREAM_ERROR;
+            }
+            stage = BLOCK_HEADER;
+        } else if (stage == BLOCK_HEADER) {
+            InputBitStream stream {input.data(), input.size()};
+            last_block = stream.read_byte() == 1;
+            mode = stream.read_byte();
+            payload_size = stream.read_u32();
+            original_size = stream.read_u32();
+            block_checksum = version >= 3 ? stream.read_u32() : 0;
+            if (original_size > block_size || payload_size > max_payload_size(block_size)) {
+                failed = true;
+                return PZIP_STREAM_ERROR;
+            }
+            stage = PAYLOAD;
+        } else if (stage == PAYLOAD) {
+            output.resize(original_size);
+            output_pos = 0;
+            if (!ctx.decompress_block(mode, input.data(), payload_size, original_size, output.data()) ||
+                (version >= 3 && crc32c(output.data(), original_size) != block_checksum)) {
+                output.clear();
+                failed = true;
+                return PZIP_STREAM_ERROR;
+            }
+            checksum = crc32c_combine(checksum, block_checksum, original_size);
+            // Version 3 streams end with the stream checksum
+            finished = last_block && version < 3;
+            stage = last_block ? TRAILER : BLOCK_HEADER;
+        } else {
+            InputBitStream stream {input.data(), input.size()};
+            if (stream.read_u32() != checksum) {
+                failed = true;
+                return PZIP_STREAM_ERROR;
+            }
+            finished = true;
+        }
+        input.clear();
+    }
+}
@@ -0,0 +1,429 @@
+//
+//  pzip.hpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+#ifndef PZIP_HPP
+#define PZIP_HPP
+
+// Block compression library (libpzip.a) behind pcompress and pdecompress.
+// A context owns the scratch buffers of the whole pipeline. They are
+// reserved for max_block_size up front and reused by every block, so a
+// long-lived context does not go back to the allocator for them. Contexts
+// are not thread safe, use one per thread.
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "output_stream.hpp"
+#include "input_stream.hpp"
+#include "fse.hpp"
+#include "huffman.hpp"
+#include "format.hpp"
+
+using namespace std;
+
+// Settings selected by the -1 ... -9 compression levels
+struct LevelParams {
+    // Bytes per block, larger blocks give the BWT more context but take
+    // longer to sort and leave fewer blocks to spread over threads
+    u32 block_size;
+    FSEParams fse;
+    // Huffman is used when its block is at most this fraction larger than FSE
+    double huffman_margin;
+};
+
+const int MIN_LEVEL = 1;
+const int MAX_LEVEL = 9;
+const int DEFAULT_LEVEL = 6;
+// Indexed by level, higher levels use larger blocks, allow larger FSE
+// tables and more of them per block, settle for less slack between the coded
+// size and the entropy and trade less size for the faster Huffman decoder
+const LevelParams LEVELS[MAX_LEVEL + 1] = {
+    {0, {0, 0, 1}, 0},
+    {256 << 10, {10, 0.02, 1}, 0.03},
+    {384 << 10, {11, 0.02, 1}, 0.03},
+    {512 << 10, {11, 0.01, 2}, 0.02},
+    {640 << 10, {12, 0.01, 2}, 0.02},
+    {768 << 10, {12, 0.005, 2}, 0.01},
+    {900000, {13, 0.002, 2}, 0.01},
+    {2 << 20, {13, 0.001, 4}, 0.005},
+    {4 << 20, {14, 0.001, 4}, 0.0025},
+    {8 << 20, {14, 0, 4}, 0},
+};
+
+// One static FSE table of a dictionary, with its coding tables built once
+struct PzipDictTable {
+    // Normalized counts, the alphabet of the table is norm.size()
+    vector<int> norm;
+    int table_log;
+    // Coded bits of each symbol (table_log - log2(norm)), for the estimates
+    vector<double> symbol_bits;
+    FSEEncodingTable encoder;
+    FSEDecodingTable decoder;
+};
+
+// Static FSE tables trained by ptrain on sample data and shared by the
+// compressor and decompressor (--dict). A block coded with one of them
+// carries its number instead of normalized counts, which is most of the
+// header of a small record, and neither side builds a table for it.
+struct PzipDictionary {
+    // CRC-32C of the tables as saved, written in the stream header so the
+    // decoder can tell it has the right dictionary
+    u32 id = 0;
+    vector<PzipDictTable> tables;
+};
+
+// Sets the ID and builds the coding tables from the normalized counts
+void build_dictionary(PzipDictionary& dictionary);
+
+// Writes a dictionary file
+void push_dictionary(OutputBitStream& stream, const PzipDictionary& dictionary);
+
+// Parses a dictionary file and builds its tables. Returns false when data is
+// not a dictionary or does not match its ID.
+bool read_dictionary(const u8* data, size_t size, PzipDictionary& dictionary);
+
+// Encoder settings shared by every block
+struct CompressOptions {
+    LevelParams level = LEVELS[DEFAULT_LEVEL];
+    // Independent chains the decoder can walk in the inverse BWT
+    int num_cursors = 4;
+    // Interleaved FSE states (1, 2 or 4)
+    int num_states = 2;
+    // Static tables blocks may use instead of their own, none by default
+    shared_ptr<const PzipDictionary> dictionary;
+    // Let a block reuse the last FSE table the context sent (REPEAT_TABLE_FLAG).
+    // The context must then see the blocks of a stream in order, and reset()
+    // at the start of each stream.
+    bool repeat_tables = false;
+};
+
+// Time spent in each stage, summed over the blocks of a context. The
+// decoder counts the inverse BWT as bwt and the MTF/zero-run decoding as mtf.
+struct PzipStageTimes {
+    double bwt = 0;
+    // MTF fused with the RUNA/RUNB zero-run coding
+    double mtf = 0;
+    // FSE or Huffman, including the statistics and table builds, and the
+    // check for blocks to store as is
+    double entropy = 0;
+};
+
+// What the compression context did with its last block
+struct BlockStats {
+    u32 original_size;
+    // Length of the MTF/zero-run symbol stream given to the entropy coder
+    u32 symbols_size;
+    // Alphabet of the symbol stream (largest symbol + 1)
+    int num_symbols;
+    // Whole payloads the FSE and Huffman candidates would take (0 for an
+    // empty block), and the payload written
+    u32 fse_size;
+    u32 huffman_size;
+    // Same for the FSE tables mode, 0 when not tried, and its table count
+    u32 tables_size;
+    int num_tables;
+    // Same for the best dictionary table, 0 when none can code the block
+    u32 dict_size;
+    // Same for the last FSE table sent, 0 when it cannot be reused
+    u32 repeat_size;
+    u32 payload_size;
+    // Entropy coded stream of the chosen mode, the raw symbols in RLE mode
+    // and the original bytes in STORED mode
+    u32 coded_size;
+    u8 mode;
+    // FSE table log, 0 unless an FSE mode was chosen (dictionary included)
+    int table_log;
+    // Order-0 entropy of the symbols in bits per symbol, of a sample of the
+    // bytes when the block was stored without going through the pipeline
+    double entropy;
+    PzipStageTimes times;
+    // Bytes of the context buffers the block used, 0 for a block stored
+    // without going through the pipeline
+    size_t suffix_array_bytes;
+    size_t bwt_bytes;
+    size_t symbols_bytes;
+    size_t encoded_bytes;
+};
+
+class PzipCCtx {
+public:
+    // Buffers are reserved for options.level.block_size
+    PzipCCtx(const CompressOptions& options = CompressOptions());
+
+    // Runs the BWT/MTF/entropy pipeline on block (at most the block size of
+    // the options) and writes the block payload to payload (overwritten).
+    // Blocks that look incompressible skip the pipeline and blocks that do
+    // not shrink are stored as is. Returns the mode byte of the block.
+    u8 compress_block(const u8* block, u32 block_size, vector<u8>& payload);
+
+    // Forgets the last table sent, the next block starts a stream
+    void reset();
+
+    const BlockStats& stats() const {
+        return last_stats;
+    }
+
+    const CompressOptions& compress_options() const {
+        return options;
+    }
+
+    PzipStageTimes& stage_times() {
+        return times;
+    }
+
+private:
+    // Whether block is not worth the pipeline: its sampled byte entropy
+    // (returned in entropy) is close to 8 bits and its strings do not repeat
+    bool incompressible(const u8* block, u32 block_size, double& entropy);
+
+    CompressOptions options;
+    BlockStats last_stats;
+    PzipStageTimes times;
+
+    vector<int32_t> suffix_array;
+    vector<u8> bwt;
+    vector<u8> symbols;
+    vector<u8> encoded;
+    vector<int> cursors;
+    vector<int> counts;
+    vector<int> table_counts;
+    vector<int> states;
+    vector<u32> anchor_table;
+    FSEEncodingTable fse_table;
+    // Normalized counts and table log of fse_table, the last table sent,
+    // which the next blocks may reuse; empty when there is none
+    vector<int> repeat_norm;
+    int repeat_log;
+    vector<vector<int>> table_norms;
+    vector<u8> selectors;
+    vector<FSEEncodingTable> table_encoders;
+    vector<u8> tables_encoded;
+    vector<int> tables_states;
+    FSE fse;
+    Huffman huffman;
+};
+
+// The FSE table a block with REPEAT_TABLE_FLAG reuses
+struct PzipBlockTable {
+    vector<int> norm;
+    int table_log;
+};
+
+class PzipDCtx {
+public:
+    // dictionary is needed for the blocks of streams compressed with one
+    PzipDCtx(u32 max_block_size = PZIP_V1_BLOCK_SIZE, shared_ptr<const PzipDictionary> dictionary = nullptr);
+
+    // Decodes a block payload into output, which has room for original_size
+    // bytes. Returns false when the payload does not decode to that size, or
+    // needs a dictionary the context does not have. A block with
+    // REPEAT_TABLE_FLAG reuses previous_table (see next_block_table) or,
+    // when that is null, the last table this context decoded.
+    // Either way the decoding table is only built again when it changed.
+    bool decompress_block(u8 mode, const u8* payload, u32 payload_size, u32 original_size, u8* output,
+                          const PzipBlockTable* previous_table = nullptr);
+
+    // Blocks of the original format carry no length: decodes the payload at
+    // the current position of stream into output (resized). Returns false on
+    // a corrupt payload or a block larger than max_block_size.
+    bool decompress_legacy_block(InputBitStream& stream, u8 mode, vector<u8>& output);
+
+    PzipStageTimes& stage_times() {
+        return times;
+    }
+
+private:
+    // Parses a payload and undoes every stage but the inverse BWT, leaving
+    // the BWT output in last_column. Returns false on a corrupt payload.
+    bool read_payload(InputBitStream& stream, u8 mode, u32 original_size, u32 payload_size,
+                      const PzipBlockTable* previous_table);
+    // Decodes the tables and the entropy coded symbols that follow the BWT
+    // meta, alphabet size and symbol count into symbols (already sized)
+    bool read_entropy_coded(InputBitStream& stream, u8 mode, u8 flags, int num_symbols, u32 payload_size,
+                            const PzipBlockTable* previous_table);
+    bool read_cursors(InputBitStream& stream, u8 flags);
+
+    PzipStageTimes times;
+    u32 max_block_size;
+    u32 index;
+    vector<int> cursors;
+    vector<int> freqs;
+    vector<int> states;
+    vector<int> code_lengths;
+    vector<u8> encoded;
+    vector<u8> symbols;
+    vector<u8> last_column;
+    vector<uint32_t> lf;
+    FSEDecodingTable fse_table;
+    // Normalized counts of fse_table, the last table this context decoded;
+    // empty until then
+    vector<int> table_norm;
+    HuffmanDecodingTable huffman_table;
+    vector<u8> selectors;
+    vector<FSEDecodingTable> table_decoders;
+    FSE fse;
+    Huffman huffman;
+    shared_ptr<const PzipDictionary> dictionary;
+};
+
+// Last table sent in the stream after this block, which the next block with
+// REPEAT_TABLE_FLAG reuses: the table of this block when it sent one,
+// previous otherwise. Parses the head of the payload only, so the reader of
+// a stream can hand repeat blocks to any context.
+shared_ptr<const PzipBlockTable> next_block_table(u8 mode, const u8* payload, u32 payload_size,
+                                                  const shared_ptr<const PzipBlockTable>& previous);
+
+// Byte count with an optional K or M (binary) suffix, 0 when malformed
+u32 parse_size(const string& arg);
+
+// Writes the stream header of the current format, with the ID of the
+// dictionary the blocks were compressed with, if any. Returns its size.
+u32 push_stream_header(OutputBitStream& stream, u32 block_size, const PzipDictionary* dictionary = nullptr);
+
+// Writes the header of a block of the current format, checksum is the
+// CRC-32C of the original block
+void push_block_header(OutputBitStream& stream, bool last_block, u8 mode, u32 payload_size, u32 original_size,
+                       u32 checksum);
+
+// Largest payload a block of block_size bytes can have: an RLE mode block of
+// two symbols per byte with every extra cursor
+inline size_t max_payload_size(u32 block_size) {
+    return 2 * (size_t)block_size + 9 + 4 * 255;
+}
+
+// Where a block sits in the stream and in the original data, from the index footer
+struct PzipIndexEntry {
+    // Of the block header, from the start of the stream
+    u64 compressed_offset;
+    // Block header and payload
+    u32 compressed_size;
+    u64 original_offset;
+};
+
+// Writes the index footer, index_offset is where it starts in the stream
+void push_index(OutputBitStream& stream, const vector<PzipIndexEntry>& entries, u64 index_offset);
+
+// Reads the index footer at the end of a whole stream of size bytes.
+// Returns false when the stream has none or it does not fit the stream.
+bool read_index(const u8* data, size_t size, vector<PzipIndexEntry>& entries);
+
+// Caller-owned buffers of the streaming API. pos is advanced past the bytes
+// consumed from src or written to dst.
+struct PzipInBuffer {
+    const u8* src;
+    size_t size;
+    size_t pos;
+};
+
+struct PzipOutBuffer {
+    u8* dst;
+    size_t size;
+    size_t pos;
+};
+
+enum PzipFlushMode {
+    // Compress full blocks only, keep the rest of the input buffered
+    PZIP_CONTINUE,
+    // Also close the buffered partial block so everything fed so far can be
+    // decompressed (costs compression, the block is smaller)
+    PZIP_FLUSH,
+    // Close the stream with a last block
+    PZIP_END,
+};
+
+enum PzipStreamStatus {
+    // Needs more input or more output room
+    PZIP_OK,
+    // The last block has been decoded and written out
+    PZIP_STREAM_END,
+    PZIP_STREAM_ERROR,
+};
+
+// zlib-style incremental compression: feed any number of input chunks and
+// drain the stream as blocks complete. Full blocks are only closed once
+// more input shows up, so the output is the same as pcompress on the whole
+// input when PZIP_FLUSH is not used.
+class PzipCStream {
+public:
+    PzipCStream(const CompressOptions& options = CompressOptions());
+
+    // Consumes as much of in as fits, writes ready output to out. Returns
+    // the number of bytes still waiting for room in out: with PZIP_FLUSH
+    // or PZIP_END, call again (with the same mode) until it returns 0.
+    // Once PZIP_END returned 0 the stream is complete, reset() starts a new one.
+    size_t compress(PzipInBuffer& in, PzipOutBuffer& out, PzipFlushMode mode);
+
+    void reset();
+
+    PzipStageTimes& stage_times() {
+        return ctx.stage_times();
+    }
+
+private:
+    void compress_input(bool last_block);
+    void drain(PzipOutBuffer& out);
+
+    PzipCCtx ctx;
+    // Partial block
+    vector<u8> input;
+    vector<u8> payload;
+    // Framed output not written to the caller yet
+    vector<u8> pending;
+    size_t pending_pos;
+    // CRC-32C of the input so far
+    u32 checksum;
+    bool finished;
+};
+
+// Incremental decompression of streams with a header (the original
+// headerless format is not supported). Blocks are decoded as soon as their
+// payload is complete, checked against their checksum and handed out
+// through the caller's buffer.
+class PzipDStream {
+public:
+    // Streams compressed with a dictionary only decode with the same one
+    PzipDStream(shared_ptr<const PzipDictionary> dictionary = nullptr);
+
+    PzipStreamStatus decompress(PzipInBuffer& in, PzipOutBuffer& out);
+
+    void reset();
+
+    PzipStageTimes& stage_times() {
+        return ctx.stage_times();
+    }
+
+private:
+    enum Stage {
+        STREAM_HEADER,
+        BLOCK_HEADER,
+        PAYLOAD,
+        TRAILER,
+    };
+
+    PzipDCtx ctx;
+    shared_ptr<const PzipDictionary> dictionary;
+    Stage stage;
+    // From the stream header
+    u8 version;
+    u32 block_size;
+    // Bytes of the header or payload being read
+    vector<u8> input;
+    u8 mode;
+    u32 payload_size;
+    u32 original_size;
+    u32 block_checksum;
+    bool last_block;
+    // CRC-32C of the blocks decoded so far
+    u32 checksum;
+    vector<u8> output;
+    size_t output_pos;
+    bool finished;
+    bool failed;
+};
+
+#endif
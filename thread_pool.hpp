@@ -0,0 +1,78 @@
+//
+//  thread_pool.hpp
+//  pzip
+//
+//  Copyright © 2020 Phuc Nguyen. All rights reserved.
+//
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+// A fixed set of worker threads pulling tasks from a FIFO queue.
+// submit() returns a future so callers can collect results in their own order.
+class ThreadPool {
+public:
+    ThreadPool(int num_threads): stopping{false} {
+        for (int i = 0; i < num_threads; i++) {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    }
+
+    template<typename F>
+    auto submit(F task) -> std::future<decltype(task())> {
+        using R = decltype(task());
+        auto packaged = std::make_shared<std::packaged_task<R()>>(std::move(task));
+        std::future<R> result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push([packaged] { (*packaged)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+private:
+    void run() {
+        while (1) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+};
+
+#endif